@@ -39,6 +39,10 @@
 #include <signal.h>
 #include <time.h>
 #include <grp.h>
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "lv8.hpp"
 #include "macros.hpp"
@@ -46,59 +50,10 @@
 #if LV8_BINDING
 using namespace v8;
 
-/*
- * ArrayBuffers are rather unfortunate in V8. Try to do our
- * best to not clash with other ABs.
- */
-static void
-pab_weak_callback(const WeakCallbackData<ArrayBuffer,
-    Persistent<ArrayBuffer> > &data)
-{
-  Persistent<ArrayBuffer> *pab = data.GetParameter();
-  free(data.GetValue()->ToObject()->GetAlignedPointerFromInternalField(1));
-  pab->Reset();
-  delete pab;
-}
-
-/* Externalize new ArrayBuffer */
-#define LV8_AB_MAGIC (void*)(0xDADE1330)
-static void *externalize_ab(Handle<ArrayBuffer> ab)
-{
-  ArrayBuffer::Contents contents = ab->Externalize();
-  void *ptr = contents.Data();
-  ab->SetAlignedPointerInInternalField(0, LV8_AB_MAGIC);
-  ab->SetAlignedPointerInInternalField(1, ptr);
-  Persistent<ArrayBuffer> *pab = new Persistent<ArrayBuffer>();
-  pab->Reset(ISOLATE, ab);
-  pab->SetWeak(pab, pab_weak_callback);
-  pab->MarkIndependent();
-  return ptr;
-}
-
-/* Translate ArrayBuffer to pointer. */
-static inline void *get_arraybuffer(Handle<ArrayBuffer> ab)
-{
-  if (!ab->IsExternal()) {
-    return externalize_ab(ab);
-#ifndef NDEBUG
-  } else if (ab->GetAlignedPointerFromInternalField(0) != LV8_AB_MAGIC) {
-    ISOLATE->ThrowException( // Belongs to somebody else
-        Exception::Error(UTF8("Incompatible ArrayBuffer")));
-    return 0;
-#endif
-  } else {
-    return ab->GetAlignedPointerFromInternalField(1);
-  }
-}
-
 /* Translate ArrayBuffer (or ArrayBufferView). */
 static inline void *get_buf(Handle<Object> b, int32_t off)
 {
-  if (b->IsArrayBuffer())
-    return get_arraybuffer(b.As<ArrayBuffer>());
-  Handle<ArrayBufferView> abv = b.As<ArrayBufferView>();
-  return (void*)(((char*)get_arraybuffer(abv->Buffer()))
-      + abv->ByteOffset());
+  return lv8_get_buf(b);
 }
 
 /* Unix bindings. */
@@ -321,27 +276,61 @@ static void binding_readdir(const v8::FunctionCallbackInfo<Value> &info) {
       FunctionTemplate::New(ISOLATE, fn, External::New(ISOLATE, data)))
 
 
-/* Eval a string with explicit and filename. */
-static void js_vm_eval(const v8::FunctionCallbackInfo<Value> &info) {
-  HandleScope scope(ISOLATE);
-  UNWRAP_L;
-  Handle<Value> ctx = info[0];
-  Handle<Value> source = info[1];
-  Handle<Value> file = info[2];
-  Handle<Value> dryrun = info[3];
+#if !NON_POSIX
+/* User timing, ms since trace epoch (lv8.trace). */
+static void js_now(const v8::FunctionCallbackInfo<Value> &info) {
+  info.GetReturnValue().Set(lv8_trace_now() / 1e6);
+}
 
-  Handle<Context> c;
+static void js_mark(const v8::FunctionCallbackInfo<Value> &info) {
+  String::Utf8Value name(info[0]);
+  lv8_trace_mark(*name, name.length());
+}
 
+static void js_measure(const v8::FunctionCallbackInfo<Value> &info) {
+  String::Utf8Value name(info[0]);
+  lv8_trace_measure(*name, name.length(),
+      lv8_ms2ns(info[1]->NumberValue()), info[2]->IsUndefined() ?
+      LV8_TRACE_NOW : lv8_ms2ns(info[2]->NumberValue()));
+}
+#endif
+
+/* Unwrap execution context argument, throws if invalid. */
+static lv8_context *vm_context(lua_State *L, Handle<Value> ctx)
+{
   lv8_context *p = 0;
-  
   if (!ctx.IsEmpty() && ctx->IsObject())
     p = lv8_unwrap_js(L, ctx->ToObject(), true);
-  if (!(p && (p->type == LV8_OBJ_CTX || p->type == LV8_OBJ_SB))) {
+  if (!(p && p != LV8_DEAD_PROXY &&
+        (p->type == LV8_OBJ_CTX || p->type == LV8_OBJ_SB))) {
     THROW("Invalid execution context");
-    return;
+    return 0;
   }
+  return p;
+}
 
-  c = CREF(p);
+/* Decorate caught error with message details and rethrow. */
+static void vm_rethrow(TryCatch &tc)
+{
+  Handle<Object> exo = tc.Exception()->ToObject();
+  Handle<Message> msg = tc.Message();
+  if (!msg.IsEmpty()) { // V8 does not propagate this into error objects.
+    exo->Set(UTF8("sourceLine"), msg->GetSourceLine());
+    exo->Set(UTF8("scriptResourceName"), msg->GetScriptResourceName());
+    exo->Set(UTF8("lineNumber"), Int32::New(ISOLATE, msg->GetLineNumber()));
+    exo->Set(UTF8("startPosition"), Int32::New(ISOLATE, msg->GetStartPosition()));
+    exo->Set(UTF8("endPosition"), Int32::New(ISOLATE, msg->GetEndPosition()));
+    exo->Set(UTF8("startColumn"), Int32::New(ISOLATE, msg->GetStartColumn()));
+    exo->Set(UTF8("endColumn"), Int32::New(ISOLATE, msg->GetEndColumn()));
+  }
+  tc.ReThrow();
+}
+
+/* Compile and (unless dryrun) run source in context p. */
+static void vm_eval(const v8::FunctionCallbackInfo<Value> &info,
+    lv8_context *p, Handle<Value> source, Handle<Value> file, bool dryrun)
+{
+  Handle<Context> c = CREF(p);
   c->Enter();
 
   TryCatch tc;
@@ -349,29 +338,27 @@ static void js_vm_eval(const v8::FunctionCallbackInfo<Value> &info) {
   Handle<Script> script = Script::Compile(source->ToString(), &orig);
   Handle<Value> ex = tc.Exception();
 
-  if (ex.IsEmpty() && !(!dryrun.IsEmpty() && dryrun->IsTrue())) {
+  if (ex.IsEmpty() && !dryrun) {
     info.GetReturnValue().Set(script->Run()); // Execute.
     ex = tc.Exception();
   }
 
-  if (!ex.IsEmpty() || tc.HasCaught()) { // Caught error.
-    Handle<Object> exo = ex->ToObject();
-    Handle<Message> msg = tc.Message();
-    if (!msg.IsEmpty()) { // V8 does not propagate this into error objects.
-      exo->Set(UTF8("sourceLine"), msg->GetSourceLine());
-      exo->Set(UTF8("scriptResourceName"), msg->GetScriptResourceName());
-      exo->Set(UTF8("lineNumber"), Int32::New(ISOLATE, msg->GetLineNumber()));
-      exo->Set(UTF8("startPosition"), Int32::New(ISOLATE, msg->GetStartPosition()));
-      exo->Set(UTF8("endPosition"), Int32::New(ISOLATE, msg->GetEndPosition()));
-      exo->Set(UTF8("startColumn"), Int32::New(ISOLATE, msg->GetStartColumn()));
-      exo->Set(UTF8("endColumn"), Int32::New(ISOLATE, msg->GetEndColumn()));
-    }
-    tc.ReThrow();
-  }
+  if (!ex.IsEmpty() || tc.HasCaught()) // Caught error.
+    vm_rethrow(tc);
 
   c->Exit();
 }
 
+/* Eval a string with explicit and filename. */
+static void js_vm_eval(const v8::FunctionCallbackInfo<Value> &info) {
+  HandleScope scope(ISOLATE);
+  UNWRAP_L;
+  Handle<Value> dryrun = info[3];
+  if (lv8_context *p = vm_context(L, info[0]))
+    vm_eval(info, p, info[1], info[2],
+        !dryrun.IsEmpty() && dryrun->IsTrue());
+}
+
 /* Construct a JS context. */
 static void js_vm_context(const v8::FunctionCallbackInfo<Value> &info) {
   UNWRAP_L;
@@ -386,7 +373,8 @@ static void js_vm_context(const v8::FunctionCallbackInfo<Value> &info) {
 static void js_vm_sandbox(const v8::FunctionCallbackInfo<Value> &info) {
   UNWRAP_L;
   Handle<Object> o = info[0]->ToObject();
-  if (lv8_object *p = lv8_unwrap_js(L, o)) {
+  lv8_object *p = lv8_unwrap_js(L, o);
+  if (p && p != LV8_DEAD_PROXY) {
     lv8_push(L, p);
     lv8_context *c = lv8_sandbox_factory(L, -1);
     info.GetReturnValue().Set(OREF(c));
@@ -394,6 +382,754 @@ static void js_vm_sandbox(const v8::FunctionCallbackInfo<Value> &info) {
   }
 }
 
+#if !NON_POSIX
+/*
+ * CommonJS modules.
+ *
+ * binding.require(ctx, id, basedir) resolves id relative to basedir
+ * (or LV8_PATH search path for bare ids), compiles the module once per
+ * isolate as UnboundScript and instantiates it once per context. Only
+ * modules actually required are ever compiled. Module code runs as
+ * function(exports, require, module, __filename, __dirname).
+ *
+ * Caches:
+ * - resolution: basedir + id -> realpath (per process)
+ * - compiled:   realpath -> UnboundScript (per isolate, across contexts)
+ * - instances:  realpath -> module object (hidden on context global)
+ * - code cache: if LV8_CODECACHE names a directory, V8 code cache is
+ *               stored there and consumed while newer than the source.
+ */
+#define LV8_MODULES "lv8::modules"
+#define MOD_PREFIX "(function (exports, require, module, __filename, __dirname) { "
+#define MOD_SUFFIX "\n})"
+
+struct strtab_ent {
+  strtab_ent *next;
+  char *key;
+  void *val;
+};
+
+#define STRTAB_SIZE 256
+struct strtab {
+  strtab_ent *bucket[STRTAB_SIZE];
+};
+
+/* Hash (FNV-1a) of key of length n. */
+static uint32_t strtab_hash(const char *k, size_t n)
+{
+  uint32_t h = 2166136261u;
+  while (n--)
+    h = (h ^ (uint8_t)*k++) * 16777619u;
+  return h % STRTAB_SIZE;
+}
+
+/* Lookup key (may contain NULs, hence explicit length). */
+static void *strtab_get(strtab *t, const char *k, size_t n)
+{
+  for (strtab_ent *e = t->bucket[strtab_hash(k, n)]; e; e = e->next)
+    if (!memcmp(e->key, k, n) && !e->key[n])
+      return e->val;
+  return 0;
+}
+
+/* Insert new key. */
+static void strtab_put(strtab *t, const char *k, size_t n, void *v)
+{
+  strtab_ent *e = new strtab_ent;
+  e->key = (char*)malloc(n + 1);
+  memcpy(e->key, k, n);
+  e->key[n] = 0;
+  e->val = v;
+  uint32_t h = strtab_hash(k, n);
+  e->next = t->bucket[h];
+  t->bucket[h] = e;
+}
+
+struct lv8_module {
+  char *path;
+  char *dir;
+  Persistent<UnboundScript> script;
+};
+
+static strtab mod_resolved;
+static strtab mod_compiled;
+
+/* Regular file exists at path? Canonicalize into out. */
+static bool resolve_file(const char *path, char *out)
+{
+  struct stat st;
+  return realpath(path, out) && !stat(out, &st) && S_ISREG(st.st_mode);
+}
+
+/* Try path, path.js and path/index.js. */
+static bool resolve_candidate(const char *path, char *out)
+{
+  char buf[PATH_MAX+1];
+  if (resolve_file(path, out))
+    return true;
+  snprintf(buf, sizeof(buf), "%s.js", path);
+  if (resolve_file(buf, out))
+    return true;
+  snprintf(buf, sizeof(buf), "%s/index.js", path);
+  return resolve_file(buf, out);
+}
+
+/* Resolve module id relative to base directory (cached). */
+static const char *module_resolve(const char *base, const char *id)
+{
+  size_t bl = strlen(base), il = strlen(id);
+  char key[bl + il + 2];
+  memcpy(key, base, bl + 1);
+  memcpy(key + bl + 1, id, il + 1);
+  const char *path = (const char*)strtab_get(&mod_resolved, key, bl + il + 1);
+  if (path)
+    return path;
+
+  char out[PATH_MAX+1], buf[PATH_MAX+1];
+  bool found = false;
+  if (id[0] == '/') {
+    found = resolve_candidate(id, out);
+  } else if (!strncmp(id, "./", 2) || !strncmp(id, "../", 3)) {
+    snprintf(buf, sizeof(buf), "%s/%s", base, id);
+    found = resolve_candidate(buf, out);
+  } else if (const char *lp = getenv("LV8_PATH")) { // Bare id.
+    while (!found && *lp) {
+      const char *sep = strchr(lp, ':');
+      int n = sep ? sep - lp : strlen(lp);
+      snprintf(buf, sizeof(buf), "%.*s/%s", n, lp, id);
+      found = n && resolve_candidate(buf, out);
+      lp += sep ? n + 1 : n;
+    }
+  }
+  if (!found)
+    return 0;
+  path = strdup(out);
+  strtab_put(&mod_resolved, key, bl + il + 1, (void*)path);
+  return path;
+}
+
+/* Code cache file for path, if enabled. */
+static bool codecache_name(const char *path, char *out)
+{
+  const char *dir = getenv("LV8_CODECACHE");
+  if (!dir || !*dir)
+    return false;
+  int n = snprintf(out, PATH_MAX, "%s/", dir);
+  if (n < 0 || n >= PATH_MAX - 5)
+    return false; // No room for the name.
+  for (const char *p = path; *p && n < PATH_MAX - 5; p++)
+    out[n++] = *p == '/' ? '%' : *p;
+  strcpy(out + n, ".jsc");
+  return true;
+}
+
+/* Load code cache not older than source. */
+static ScriptCompiler::CachedData *codecache_load(const char *cpath,
+    time_t mtime)
+{
+  struct stat st;
+  int fd = open(cpath, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ScriptCompiler::CachedData *cd = 0;
+  if (!fstat(fd, &st) && st.st_mtime >= mtime && st.st_size > 0) {
+    uint8_t *buf = new uint8_t[st.st_size];
+    if (read(fd, buf, st.st_size) == st.st_size)
+      cd = new ScriptCompiler::CachedData(buf, st.st_size,
+          ScriptCompiler::CachedData::BufferOwned);
+    else
+      delete[] buf;
+  }
+  close(fd);
+  return cd;
+}
+
+/* Store code cache (atomically, via rename). */
+static void codecache_store(const char *cpath,
+    const ScriptCompiler::CachedData *cd)
+{
+  char tmp[PATH_MAX+16];
+  snprintf(tmp, sizeof(tmp), "%s.%d", cpath, (int)getpid());
+  int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0)
+    return;
+  bool ok = write(fd, cd->data, cd->length) == cd->length;
+  close(fd);
+  if (!ok || rename(tmp, cpath))
+    unlink(tmp);
+}
+
+/* Read whole file into malloc'd buffer. */
+static char *read_file(const char *path, size_t *len, time_t *mtime)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  char *buf = 0;
+  if (!fstat(fd, &st)) {
+    buf = (char*)malloc(st.st_size + 1);
+    if (read(fd, buf, st.st_size) != st.st_size) {
+      free(buf);
+      buf = 0;
+    } else {
+      *len = st.st_size;
+      *mtime = st.st_mtime;
+    }
+  }
+  close(fd);
+  return buf;
+}
+
+/* Compile module at canonical path, once per isolate. */
+static lv8_module *module_compile(const char *path)
+{
+  size_t plen = strlen(path);
+  lv8_module *m = (lv8_module*)strtab_get(&mod_compiled, path, plen);
+  if (m)
+    return m;
+
+  size_t len;
+  time_t mtime;
+  char *buf = read_file(path, &len, &mtime);
+  if (!buf) {
+    ISOLATE->ThrowException(Exception::Error(
+          String::Concat(LITERAL("Cannot read module "), UTF8(path))));
+    return 0;
+  }
+  Handle<String> src = String::Concat(LITERAL(MOD_PREFIX),
+      String::Concat(UTF8(buf, String::kNormalString, (int)len),
+        LITERAL(MOD_SUFFIX)));
+  free(buf);
+
+  char cpath[PATH_MAX+1];
+  bool cache = codecache_name(path, cpath);
+  ScriptCompiler::CachedData *cd = cache ? codecache_load(cpath, mtime) : 0;
+  ScriptCompiler::CompileOptions opt = ScriptCompiler::kNoCompileOptions;
+  if (cache)
+    opt = cd ? ScriptCompiler::kConsumeCodeCache
+      : ScriptCompiler::kProduceCodeCache;
+
+  ScriptOrigin orig(UTF8(path));
+  ScriptCompiler::Source source(src, orig, cd); // Owns cd.
+  Local<UnboundScript> us = ScriptCompiler::CompileUnbound(ISOLATE,
+      &source, opt);
+  if (us.IsEmpty())
+    return 0; // Syntax error is pending.
+  if (opt == ScriptCompiler::kProduceCodeCache && source.GetCachedData())
+    codecache_store(cpath, source.GetCachedData());
+  else if (opt == ScriptCompiler::kConsumeCodeCache &&
+      source.GetCachedData()->rejected)
+    unlink(cpath); // Stale (other V8, flags), produced again next time.
+
+  m = new lv8_module();
+  memset(m, 0, sizeof(*m));
+  m->path = strdup(path);
+  m->dir = strdup(path);
+  *strrchr(m->dir, '/') = 0;
+  m->script.Reset(ISOLATE, us);
+  strtab_put(&mod_compiled, path, plen, m);
+  return m;
+}
+
+static void js_module_require(const v8::FunctionCallbackInfo<Value> &info);
+
+/* Instantiate module in context of global gl, return its exports. */
+static Handle<Value> module_require(lua_State *L, Handle<Object> gl,
+    Handle<Value> id, const char *base)
+{
+  EscapableHandleScope scope(ISOLATE);
+  const char *path = module_resolve(base, *String::Utf8Value(id));
+  if (!path) {
+    ISOLATE->ThrowException(Exception::Error(
+          String::Concat(LITERAL("Cannot find module "), id->ToString())));
+    return Handle<Value>();
+  }
+
+  Handle<String> key = LITERAL(LV8_MODULES);
+  Handle<Value> regv = gl->GetHiddenValue(key);
+  Handle<Object> reg;
+  if (regv.IsEmpty()) { // First module in this context.
+    reg = Object::New(ISOLATE);
+    reg->SetPrototype(Null(ISOLATE));
+    gl->SetHiddenValue(key, reg);
+  } else {
+    reg = regv->ToObject();
+  }
+
+  Handle<String> pstr = UTF8(path);
+  Handle<Value> cached = reg->GetRealNamedProperty(pstr);
+  if (!cached.IsEmpty()) // Already instantiated (or cyclic require).
+    return scope.Escape(cached->ToObject()->Get(LITERAL("exports")));
+
+  lv8_module *m = module_compile(path);
+  if (!m)
+    return Handle<Value>();
+  Handle<Value> fn = Local<UnboundScript>::New(ISOLATE, m->script)
+    ->BindToCurrentContext()->Run();
+  if (fn.IsEmpty())
+    return Handle<Value>();
+
+  Handle<Object> module = Object::New(ISOLATE);
+  Handle<Object> exports = Object::New(ISOLATE);
+  Handle<String> dir = UTF8(m->dir);
+  module->Set(LITERAL("exports"), exports);
+  module->Set(LITERAL("id"), pstr);
+  reg->ForceSet(pstr, module); // Before running, for cycles.
+
+  Handle<Array> data = Array::New(ISOLATE, 3);
+  data->Set(0, External::New(ISOLATE, L));
+  data->Set(1, dir);
+  data->Set(2, gl);
+  Handle<Value> argv[] = {
+    exports, Function::New(ISOLATE, js_module_require, data),
+    module, pstr, dir
+  };
+  if (Handle<Function>::Cast(fn)->Call(exports, 5, argv).IsEmpty()) {
+    reg->ForceDelete(pstr); // Failed, allow retry.
+    return Handle<Value>();
+  }
+  return scope.Escape(module->Get(LITERAL("exports")));
+}
+
+/* require() as seen by module code. */
+static void js_module_require(const v8::FunctionCallbackInfo<Value> &info)
+{
+  HandleScope scope(ISOLATE);
+  Handle<Array> data = Handle<Array>::Cast(info.Data());
+  lua_State *L = (lua_State*)External::Cast(*data->Get(0))->Value();
+  Handle<Value> res = module_require(L, data->Get(2)->ToObject(), info[0],
+      *String::Utf8Value(data->Get(1)));
+  if (!res.IsEmpty())
+    info.GetReturnValue().Set(res);
+}
+
+/* binding.require(ctx, id, basedir) */
+static void js_vm_require(const v8::FunctionCallbackInfo<Value> &info) {
+  HandleScope scope(ISOLATE);
+  UNWRAP_L;
+  lv8_context *p = vm_context(L, info[0]);
+  if (!p)
+    return;
+
+  char cwd[PATH_MAX+1];
+  const char *base = cwd;
+  String::Utf8Value basestr(info[2]);
+  if (info[2]->IsString())
+    base = *basestr;
+  else if (!getcwd(cwd, sizeof(cwd)))
+    strcpy(cwd, ".");
+
+  Handle<Context> c = CREF(p);
+  c->Enter();
+  TryCatch tc;
+  Handle<Value> res = module_require(L, OREF(p), info[1], base);
+  if (tc.HasCaught())
+    vm_rethrow(tc);
+  else
+    info.GetReturnValue().Set(res);
+  c->Exit();
+}
+
+/*
+ * Off-thread compilation.
+ *
+ * binding.compileAsync(path | {source=, name=}) starts compiling on
+ * a background thread and returns a handle. binding.compileReady(h)
+ * polls, binding.compileFinish(ctx, h) waits and finalizes (throwing
+ * syntax errors), binding.run(ctx, h) executes it (in any context,
+ * finishing first if needed). With LV8_STREAMING, V8 script streaming
+ * parses chunks as they are read. Otherwise only the reading happens
+ * off-thread and compilation is done by compileFinish.
+ */
+#define CHUNK_SIZE (64*1024)
+
+struct compile_job : lv8_deferred {
+  lv8_state *state;
+  pthread_t thread;
+  volatile int done;
+  int fd; // File source, or
+  const char *mem; // in-memory source.
+  size_t memlen, mempos;
+  char *acc; // Everything read so far (full source for finalization).
+  size_t acclen, accmax;
+  char *name;
+#if LV8_STREAMING
+  ScriptCompiler::StreamedSource *streamed;
+  ScriptCompiler::ScriptStreamingTask *task;
+#endif
+  Persistent<UnboundScript> script;
+  Persistent<Value> error; // Compile failed, source is consumed.
+  Persistent<Object> handle;
+};
+
+/* Next chunk of source, appended to job->acc. Returns 0 at EOF. */
+static size_t job_read(compile_job *job, const uint8_t **chunk)
+{
+  if (job->acclen + CHUNK_SIZE > job->accmax) {
+    job->accmax = (job->accmax + CHUNK_SIZE) * 2;
+    job->acc = (char*)realloc(job->acc, job->accmax);
+  }
+  char *p = job->acc + job->acclen;
+  ssize_t n;
+  if (job->mem) {
+    n = job->memlen - job->mempos;
+    if (n > CHUNK_SIZE) n = CHUNK_SIZE;
+    memcpy(p, job->mem + job->mempos, n);
+    job->mempos += n;
+  } else {
+    do {
+      n = read(job->fd, p, CHUNK_SIZE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) n = 0;
+  }
+  job->acclen += n;
+  if (chunk)
+    *chunk = (const uint8_t*)p;
+  return n;
+}
+
+#if LV8_STREAMING
+/* Feeds V8 streamer from job. */
+class job_stream : public ScriptCompiler::ExternalSourceStream {
+  public:
+  job_stream(compile_job *j) : job(j) {}
+  virtual size_t GetMoreData(const uint8_t **src) {
+    const uint8_t *chunk;
+    size_t n = job_read(job, &chunk);
+    if (!n)
+      return 0;
+    uint8_t *copy = new uint8_t[n]; // Owned by V8.
+    memcpy(copy, chunk, n);
+    *src = copy;
+    return n;
+  }
+  private:
+  compile_job *job;
+};
+#endif
+
+/* Background thread body. */
+static void *job_thread(void *ud)
+{
+  compile_job *job = (compile_job*)ud;
+#if LV8_STREAMING
+  job->task->Run();
+#else
+  while (job_read(job, 0));
+#endif
+  __sync_synchronize();
+  job->done = 1;
+  return 0;
+}
+
+/* Release job (thread must be joined). */
+static void job_free(compile_job *job)
+{
+#if LV8_STREAMING
+  delete job->task;
+  delete job->streamed;
+#endif
+  if (job->fd >= 0)
+    close(job->fd);
+  free((void*)job->mem);
+  free(job->acc);
+  free(job->name);
+  job->script.Reset();
+  job->error.Reset();
+  job->handle.Reset();
+  delete job;
+}
+
+/* Deferred part of job_weak_callback, once the thread is done. */
+static bool job_release(lua_State *L, lv8_deferred *d)
+{
+  compile_job *job = (compile_job*)d;
+  if (L && job->thread && !job->done)
+    return false; // Do not block a safepoint, try next one.
+  if (job->thread)
+    pthread_join(job->thread, 0);
+  job_free(job);
+  return true;
+}
+
+/* Handle collected by JS, join and free outside of GC. */
+static void
+job_weak_callback(const WeakCallbackData<Object, compile_job> &data)
+{
+  compile_job *job = data.GetParameter();
+  job->handle.Reset();
+  lv8_defer(job->state, job);
+}
+
+/*
+ * Join thread and turn source into UnboundScript. Throws on error, the
+ * same error again on later calls (streamed data is finalized once).
+ */
+static bool job_finish(compile_job *job, TryCatch &tc)
+{
+  if (!job->script.IsEmpty())
+    return true;
+  if (!job->error.IsEmpty()) {
+    ISOLATE->ThrowException(Local<Value>::New(ISOLATE, job->error));
+    return false;
+  }
+  if (job->thread) {
+    pthread_join(job->thread, 0);
+    job->thread = 0;
+  }
+  Handle<String> src = UTF8(job->acc, String::kNormalString, (int)job->acclen);
+  ScriptOrigin orig(UTF8(job->name));
+#if LV8_STREAMING
+  Local<Script> s = ScriptCompiler::Compile(ISOLATE, job->streamed, src, orig);
+  if (!s.IsEmpty())
+    job->script.Reset(ISOLATE, s->GetUnboundScript());
+#else
+  ScriptCompiler::Source source(src, orig);
+  Local<UnboundScript> us = ScriptCompiler::CompileUnbound(ISOLATE, &source);
+  if (!us.IsEmpty())
+    job->script.Reset(ISOLATE, us);
+#endif
+  if (job->script.IsEmpty())
+    job->error.Reset(ISOLATE, tc.HasCaught() ? tc.Exception() :
+        Exception::Error(LITERAL("Compilation failed")));
+  free(job->acc); // Now held by V8.
+  job->acc = 0;
+  return !job->script.IsEmpty();
+}
+
+/* Tags handles made from job_tpl, other objects have fields too. */
+#define JOB_MAGIC (void*)(0xDADE10B0)
+
+/* Unwrap job handle argument. */
+static compile_job *job_unwrap(Handle<Value> h)
+{
+  if (h.IsEmpty() || !h->IsObject() ||
+      h.As<Object>()->InternalFieldCount() != 2 ||
+      h.As<Object>()->GetAlignedPointerFromInternalField(1) != JOB_MAGIC) {
+    THROW("Invalid compile handle");
+    return 0;
+  }
+  return (compile_job*)h.As<Object>()->GetAlignedPointerFromInternalField(0);
+}
+
+static Persistent<ObjectTemplate> job_tpl;
+
+/* binding.compileAsync(path | {source=, name=}) */
+static void js_vm_compile_async(const v8::FunctionCallbackInfo<Value> &info) {
+  HandleScope scope(ISOLATE);
+  if (!info[0]->IsString() && !info[0]->IsObject()) {
+    THROW("Expected path or {source=, name=}");
+    return;
+  }
+  UNWRAP_L;
+  compile_job *job = new compile_job();
+  memset(job, 0, sizeof(*job));
+  job->release = job_release;
+  job->state = lv8_state_get(L);
+  job->fd = -1;
+  if (info[0]->IsString()) {
+    job->name = strdup(ASTR(0));
+    if ((job->fd = open(job->name, O_RDONLY)) < 0) {
+      do_errno(info, "open");
+      job_free(job);
+      return;
+    }
+  } else {
+    Handle<Object> o = info[0].As<Object>();
+    String::Utf8Value src(o->Get(LITERAL("source")));
+    job->name = strdup(*String::Utf8Value(o->Get(LITERAL("name"))));
+    job->memlen = src.length();
+    job->mem = (const char*)memcpy(malloc(job->memlen + 1), *src, job->memlen);
+  }
+
+#if LV8_STREAMING
+  job->streamed = new ScriptCompiler::StreamedSource(new job_stream(job),
+      ScriptCompiler::StreamedSource::UTF8);
+  job->task = ScriptCompiler::StartStreamingScript(ISOLATE, job->streamed);
+#endif
+  if (pthread_create(&job->thread, 0, job_thread, job)) {
+    job->thread = 0;
+    do_errno(info, "pthread_create");
+    job_free(job);
+    return;
+  }
+
+  if (job_tpl.IsEmpty()) {
+    Handle<ObjectTemplate> tpl = ObjectTemplate::New();
+    tpl->SetInternalFieldCount(2); // job, JOB_MAGIC
+    job_tpl.Reset(ISOLATE, tpl);
+  }
+  Handle<Object> h = Local<ObjectTemplate>::New(ISOLATE, job_tpl)->NewInstance();
+  h->SetAlignedPointerInInternalField(0, job);
+  h->SetAlignedPointerInInternalField(1, JOB_MAGIC);
+  job->handle.Reset(ISOLATE, h);
+  job->handle.SetWeak(job, job_weak_callback);
+  info.GetReturnValue().Set(h);
+}
+
+/* binding.compileReady(h) */
+static void js_vm_compile_ready(const v8::FunctionCallbackInfo<Value> &info) {
+  HandleScope scope(ISOLATE);
+  if (compile_job *job = job_unwrap(info[0]))
+    info.GetReturnValue().Set(Boolean::New(ISOLATE, job->done));
+}
+
+/* binding.compileFinish(ctx, h) */
+static void js_vm_compile_finish(const v8::FunctionCallbackInfo<Value> &info) {
+  HandleScope scope(ISOLATE);
+  UNWRAP_L;
+  lv8_context *p = vm_context(L, info[0]);
+  compile_job *job = p ? job_unwrap(info[1]) : 0;
+  if (!job)
+    return;
+  Handle<Context> c = CREF(p);
+  c->Enter();
+  TryCatch tc;
+  if (!job_finish(job, tc))
+    vm_rethrow(tc);
+  else
+    info.GetReturnValue().Set(info[1]);
+  c->Exit();
+}
+
+/* binding.run(ctx, h) */
+static void js_vm_run(const v8::FunctionCallbackInfo<Value> &info) {
+  HandleScope scope(ISOLATE);
+  UNWRAP_L;
+  lv8_context *p = vm_context(L, info[0]);
+  compile_job *job = p ? job_unwrap(info[1]) : 0;
+  if (!job)
+    return;
+  Handle<Context> c = CREF(p);
+  c->Enter();
+  TryCatch tc;
+  if (job_finish(job, tc)) {
+    Handle<Value> res = Local<UnboundScript>::New(ISOLATE, job->script)
+      ->BindToCurrentContext()->Run();
+    if (!tc.HasCaught())
+      info.GetReturnValue().Set(res);
+  }
+  if (tc.HasCaught())
+    vm_rethrow(tc);
+  c->Exit();
+}
+/*
+ * Script sources straight from mmap'd file. ASCII files are used
+ * as-is (external one-byte string, no copy, no V8 heap), mapping
+ * lives until V8 disposes the string. Files with UTF8 are decoded
+ * once to an external two-byte string outside of V8 heap.
+ */
+class mmap_onebyte : public String::ExternalOneByteStringResource {
+  public:
+  mmap_onebyte(void *p, size_t n) : ptr(p), len(n) {}
+  virtual ~mmap_onebyte() { munmap(ptr, len); }
+  virtual const char *data() const { return (const char*)ptr; }
+  virtual size_t length() const { return len; }
+  private:
+  void *ptr;
+  size_t len;
+};
+
+class heap_twobyte : public String::ExternalStringResource {
+  public:
+  heap_twobyte(uint16_t *p, size_t n) : ptr(p), len(n) {}
+  virtual ~heap_twobyte() { free(ptr); }
+  virtual const uint16_t *data() const { return ptr; }
+  virtual size_t length() const { return len; }
+  private:
+  uint16_t *ptr;
+  size_t len;
+};
+
+/* Is buffer 7bit clean? */
+static bool is_ascii(const uint8_t *p, size_t n)
+{
+  uint8_t acc = 0;
+  while (n--)
+    acc |= *p++;
+  return !(acc & 0x80);
+}
+
+/* Decode UTF8 to UTF16, invalid sequences become U+FFFD. */
+static size_t utf8_decode(const uint8_t *s, size_t n, uint16_t *out)
+{
+  size_t o = 0;
+  for (size_t i = 0; i < n;) {
+    uint32_t c = s[i], need;
+    if (c < 0x80) { out[o++] = c; i++; continue; }
+    else if ((c & 0xe0) == 0xc0) { need = 1; c &= 0x1f; }
+    else if ((c & 0xf0) == 0xe0) { need = 2; c &= 0x0f; }
+    else if ((c & 0xf8) == 0xf0) { need = 3; c &= 0x07; }
+    else { out[o++] = 0xfffd; i++; continue; }
+    if (i + need >= n) { // Cut off at EOF.
+      out[o++] = 0xfffd;
+      break;
+    }
+    size_t j;
+    for (j = 1; j <= need && (s[i+j] & 0xc0) == 0x80; j++)
+      c = (c << 6) | (s[i+j] & 0x3f);
+    if (j <= need) { // Truncated sequence.
+      out[o++] = 0xfffd;
+      i += j;
+      continue;
+    }
+    i += j;
+    if (c >= 0x10000) { // Surrogate pair.
+      c -= 0x10000;
+      out[o++] = 0xd800 | (c >> 10);
+      out[o++] = 0xdc00 | (c & 0x3ff);
+    } else {
+      out[o++] = c;
+    }
+  }
+  return o;
+}
+
+/* Map file at path as JS string. Empty handle and errno on failure. */
+static Handle<String> mmap_source(const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return Handle<String>();
+  if (fstat(fd, &st)) {
+    close(fd);
+    return Handle<String>();
+  }
+  if (!st.st_size) {
+    close(fd);
+    return String::Empty(ISOLATE);
+  }
+  void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return Handle<String>();
+  if (is_ascii((const uint8_t*)p, st.st_size))
+    return String::NewExternal(ISOLATE, new mmap_onebyte(p, st.st_size));
+  uint16_t *u = (uint16_t*)malloc(st.st_size * sizeof(uint16_t));
+  size_t n = utf8_decode((const uint8_t*)p, st.st_size, u);
+  munmap(p, st.st_size);
+  return String::NewExternal(ISOLATE, new heap_twobyte(u, n));
+}
+
+/* binding.evalFile(ctx, path, dryrun) */
+static void js_vm_eval_file(const v8::FunctionCallbackInfo<Value> &info) {
+  HandleScope scope(ISOLATE);
+  UNWRAP_L;
+  Handle<Value> dryrun = info[2];
+  lv8_context *p = vm_context(L, info[0]);
+  if (!p)
+    return;
+  Handle<String> source = mmap_source(ASTR(1));
+  if (source.IsEmpty()) {
+    do_errno(info, "open");
+    return;
+  }
+  vm_eval(info, p, source, info[1], !dryrun.IsEmpty() && dryrun->IsTrue());
+}
+#endif
+
 /* Initialize low-level bindings. */
 Handle<ObjectTemplate> lv8_binding_init(lua_State *L)
 {
@@ -408,6 +1144,17 @@ Handle<ObjectTemplate> lv8_binding_init(lua_State *L)
   JS_DEFUN(b, "eval", js_vm_eval, L); // Execute.
   JS_DEFUN(b, "context", js_vm_context, L); // Create context.
   JS_DEFUN(b, "sandbox", js_vm_sandbox, L); // Create sandbox.
+#if !NON_POSIX
+  JS_DEFUN(b, "require", js_vm_require, L); // Load CommonJS module.
+  JS_DEFUN(b, "compileAsync", js_vm_compile_async, L); // Background compile.
+  JS_DEFUN(b, "compileReady", js_vm_compile_ready, L); // Poll.
+  JS_DEFUN(b, "compileFinish", js_vm_compile_finish, L); // Finalize.
+  JS_DEFUN(b, "run", js_vm_run, L); // Run compiled script.
+  JS_DEFUN(b, "evalFile", js_vm_eval_file, L); // Eval mmap'd file.
+  JS_DEFUN(b, "now", js_now, L); // performance.now()
+  JS_DEFUN(b, "mark", js_mark, L); // Trace instant.
+  JS_DEFUN(b, "measure", js_measure, L); // Trace span.
+#endif
 
   b->Set(LITERAL("v8_version"), UTF8(V8::GetVersion()));
 
@@ -0,0 +1,375 @@
+/*
+ * Lua <-> V8 bridge, direct C api.
+ * (C) Copyright 2014, Karel Tuma <kat@lua.cz>, All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NDEBUG
+#include <v8-debug.h>
+#else
+#include <v8.h>
+#endif
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define LV8_CPP
+#include "lv8.hpp"
+#include "macros.hpp"
+
+using namespace v8;
+
+/*
+ * Notes on C api:
+ *
+ * Values never touch the Lua stack. The only Lua involvement is
+ * a single trampoline frame around anything which might run JS
+ * (lv8_capi_invoke), as interceptors of Lua proxies reachable from
+ * JS expect to be called from within a function holding lv8 upvalues.
+ *
+ * Numbers and booleans live in the handle itself. Strings and buffers
+ * created from C are kept as C copies until first seen by V8, and are
+ * then anchored in handle via Persistent<>. Buffer memory is adopted
+ * by the ArrayBuffer at that point.
+ */
+
+/* Allocate new handle. */
+static lv8_value *value_new(int type)
+{
+  lv8_value *v = new lv8_value();
+  memset(v, 0, sizeof(*v));
+  v->type = type;
+  return v;
+}
+
+/* Make handle for JS value. */
+static lv8_value *value_wrap(Handle<Value> r)
+{
+  lv8_value *v;
+  if (r.IsEmpty() || r->IsUndefined() || r->IsNull())
+    return value_new(LV8_TNIL);
+  /* Boxed primitives are unwrapped, objects are truthy. */
+  if (r->IsBoolean() || r->IsBooleanObject()) {
+    v = value_new(LV8_TBOOLEAN);
+    v->num = r->IsBoolean() ? r->BooleanValue() :
+      BooleanObject::Cast(*r)->ValueOf();
+    return v;
+  }
+  if (r->IsNumber() || r->IsNumberObject()) {
+    v = value_new(LV8_TNUMBER);
+    v->num = r->IsNumber() ? r->NumberValue() :
+      NumberObject::Cast(*r)->ValueOf();
+    return v;
+  }
+  if (r->IsStringObject()) // So lv8_tolstring() needs no context.
+    r = StringObject::Cast(*r)->ValueOf();
+  if (r->IsString())
+    v = value_new(LV8_TSTRING);
+  else if (r->IsArrayBuffer() || r->IsArrayBufferView())
+    v = value_new(LV8_TBUFFER);
+  else if (r->IsFunction())
+    v = value_new(LV8_TFUNCTION);
+  else
+    v = value_new(LV8_TOBJECT);
+  v->value.Reset(ISOLATE, r);
+  return v;
+}
+
+/* Make handle for caught exception. */
+static lv8_value *value_error(TryCatch &exc)
+{
+  lv8_value *v = value_new(LV8_TERROR);
+  Handle<Value> e = exc.Exception();
+  Handle<Value> msg = exc.StackTrace();
+  if (msg.IsEmpty() || msg->IsUndefined())
+    msg = e;
+  String::Utf8Value str(msg);
+  v->len = str.length();
+  v->data = (char*)malloc(v->len + 1);
+  memcpy(v->data, *str, v->len + 1);
+  v->value.Reset(ISOLATE, e);
+  return v;
+}
+
+/* Translate handle to JS value. Expects entered context. */
+static Handle<Value> value_js(lv8_value *v)
+{
+  if (!v)
+    return Undefined(ISOLATE);
+  switch (v->type) {
+    case LV8_TNIL:
+      return Undefined(ISOLATE);
+    case LV8_TBOOLEAN:
+      return Boolean::New(ISOLATE, v->num != 0);
+    case LV8_TNUMBER:
+      return Number::New(ISOLATE, v->num);
+  }
+  if (v->value.IsEmpty()) { // First time seen by V8.
+    if (v->type == LV8_TSTRING) {
+      v->value.Reset(ISOLATE, UTF8(v->data, String::kNormalString, (int)v->len));
+    } else {
+      assert(v->type == LV8_TBUFFER);
+      Handle<ArrayBuffer> ab = ArrayBuffer::New(ISOLATE, v->data, v->len);
+      lv8_adopt_buf(ab, v->data); // Now owned by JS.
+      v->value.Reset(ISOLATE, ab);
+    }
+  }
+  return LOCAL(v->value);
+}
+
+/* Make error handle with message s. */
+static lv8_value *value_fail(const char *s)
+{
+  lv8_value *v = value_new(LV8_TERROR);
+  v->data = strdup(s);
+  v->len = strlen(s);
+  return v;
+}
+
+/* Target object, the global one if obj is NULL, empty if not an object. */
+static Handle<Object> value_obj(lv8_context *ctx, lv8_value *obj)
+{
+  if (!obj)
+    return OREF(ctx);
+  Handle<Value> v = value_js(obj);
+  if (!v->IsObject())
+    return Handle<Object>();
+  return v.As<Object>();
+}
+
+/* Request passed through trampoline. */
+struct capi_req {
+  lv8_context *ctx;
+  lv8_value *obj;
+  const char *key;
+  lv8_value *val;
+  int argc;
+  lv8_value **argv;
+  lv8_value *res;
+};
+
+/* Run aux(req) inside ctx. Returns error handle if Lua side failed. */
+static lv8_value *capi_run(void (*aux)(lua_State *, void *), capi_req *r)
+{
+  r->res = 0;
+  if (lv8_capi_invoke(r->ctx->L, aux, r)) {
+    lua_State *L = r->ctx->L;
+    size_t n;
+    const char *s = lua_tolstring(L, -1, &n);
+    if (!r->res) {
+      r->res = value_new(LV8_TERROR);
+      r->res->data = strdup(s ? s : "?");
+      r->res->len = s ? n : 1;
+    }
+    lua_pop(L, 1);
+  }
+  return r->res;
+}
+
+/* obj[key] */
+static void capi_get_aux(lua_State *L, void *ud)
+{
+  capi_req *r = (capi_req*)ud;
+  HandleScope scope(ISOLATE);
+  Handle<Context> c = CREF(r->ctx);
+  c->Enter();
+  Handle<Object> o = value_obj(r->ctx, r->obj);
+  if (o.IsEmpty()) {
+    r->res = value_fail("target is not an object");
+    c->Exit();
+    return;
+  }
+  TryCatch exc;
+  Handle<Value> res = o->Get(UTF8(r->key));
+  r->res = exc.HasCaught() ? value_error(exc) : value_wrap(res);
+  c->Exit();
+}
+
+/* obj[key] = val */
+static void capi_set_aux(lua_State *L, void *ud)
+{
+  capi_req *r = (capi_req*)ud;
+  HandleScope scope(ISOLATE);
+  Handle<Context> c = CREF(r->ctx);
+  c->Enter();
+  Handle<Object> o = value_obj(r->ctx, r->obj);
+  if (o.IsEmpty()) {
+    r->res = value_fail("target is not an object");
+    c->Exit();
+    return;
+  }
+  TryCatch exc;
+  o->Set(UTF8(r->key), value_js(r->val));
+  if (exc.HasCaught())
+    r->res = value_error(exc);
+  c->Exit();
+}
+
+/* fn.apply(obj, argv) */
+static void capi_call_aux(lua_State *L, void *ud)
+{
+  capi_req *r = (capi_req*)ud;
+  HandleScope scope(ISOLATE);
+  Handle<Context> c = CREF(r->ctx);
+  c->Enter();
+  Handle<Value> argv[r->argc];
+  for (int i = 0; i < r->argc; i++)
+    argv[i] = value_js(r->argv[i]);
+  Handle<Value> recv = r->obj ? value_js(r->obj) : c->Global();
+  Handle<Value> fn = value_js(r->val);
+  if (!r->val || !fn->IsObject()) {
+    r->res = value_fail("not callable");
+    c->Exit();
+    return;
+  }
+  TryCatch exc;
+  Handle<Value> res = fn.As<Object>()->CallAsFunction(recv,
+      r->argc, argv);
+  r->res = exc.HasCaught() ? value_error(exc) : value_wrap(res);
+  c->Exit();
+}
+
+//////////////////////////////// PUBLIC //////////////////////////////
+
+/* Number handle. */
+lv8_value *lv8_number(double n)
+{
+  lv8_value *v = value_new(LV8_TNUMBER);
+  v->num = n;
+  return v;
+}
+
+/* Boolean handle. */
+lv8_value *lv8_boolean(int b)
+{
+  lv8_value *v = value_new(LV8_TBOOLEAN);
+  v->num = !!b;
+  return v;
+}
+
+/* String handle (UTF8, copied). */
+lv8_value *lv8_string(const char *s, size_t len)
+{
+  lv8_value *v = value_new(LV8_TSTRING);
+  v->data = (char*)malloc(len + 1);
+  memcpy(v->data, s, len);
+  v->data[len] = 0;
+  v->len = len;
+  return v;
+}
+
+/* ArrayBuffer handle (copied). */
+lv8_value *lv8_buffer(const void *p, size_t len)
+{
+  lv8_value *v = value_new(LV8_TBUFFER);
+  v->data = (char*)malloc(len ? len : 1);
+  memcpy(v->data, p, len);
+  v->len = len;
+  return v;
+}
+
+/* Global object of context. */
+lv8_value *lv8_global(lv8_context *ctx)
+{
+  HandleScope scope(ISOLATE);
+  return value_wrap(OREF(ctx));
+}
+
+/* Get obj[key], obj == NULL means global. */
+lv8_value *lv8_get(lv8_context *ctx, lv8_value *obj, const char *key)
+{
+  capi_req r = { ctx, obj, key };
+  return capi_run(capi_get_aux, &r);
+}
+
+/* Set obj[key] = val, returns 0 on success. */
+int lv8_set(lv8_context *ctx, lv8_value *obj, const char *key, lv8_value *val)
+{
+  capi_req r = { ctx, obj, key, val };
+  lv8_value *err = capi_run(capi_set_aux, &r);
+  if (!err)
+    return 0;
+  lv8_free(err);
+  return -1;
+}
+
+/* Call fn with this = self (NULL means global). */
+lv8_value *lv8_call(lv8_context *ctx, lv8_value *fn, lv8_value *self,
+    int argc, lv8_value **argv)
+{
+  capi_req r = { ctx, self, 0, fn, argc, argv };
+  return capi_run(capi_call_aux, &r);
+}
+
+/* Type of handle. */
+int lv8_type(const lv8_value *v)
+{
+  return v ? v->type : LV8_TNIL;
+}
+
+/* Numeric value, NaN if not a number. */
+double lv8_tonumber(const lv8_value *v)
+{
+  if (v && (v->type == LV8_TNUMBER || v->type == LV8_TBOOLEAN))
+    return v->num;
+  if (v && v->type == LV8_TSTRING && v->data)
+    return strtod(v->data, 0);
+  return strtod("nan", 0);
+}
+
+/* UTF8 contents of string (or error message), cached in handle. */
+const char *lv8_tolstring(lv8_value *v, size_t *len)
+{
+  if (!v || (v->type != LV8_TSTRING && v->type != LV8_TERROR))
+    return 0;
+  if (!v->data) {
+    HandleScope scope(ISOLATE);
+    String::Utf8Value str(LOCAL(v->value));
+    v->len = str.length();
+    v->data = (char*)malloc(v->len + 1);
+    memcpy(v->data, *str, v->len + 1);
+  }
+  if (len) *len = v->len;
+  return v->data;
+}
+
+/* Contents of ArrayBuffer (or view), valid while handle lives. */
+void *lv8_tobuffer(lv8_value *v, size_t *len)
+{
+  if (!v || v->type != LV8_TBUFFER)
+    return 0;
+  if (v->value.IsEmpty()) {
+    if (len) *len = v->len;
+    return v->data;
+  }
+  HandleScope scope(ISOLATE);
+  return lv8_get_buf(LOCAL(v->value)->ToObject(), len);
+}
+
+/* Release handle. */
+void lv8_free(lv8_value *v)
+{
+  if (!v) return;
+  bool adopted = v->type == LV8_TBUFFER && !v->value.IsEmpty();
+  v->value.Reset();
+  if (!adopted)
+    free(v->data);
+  delete v;
+}
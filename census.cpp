@@ -0,0 +1,260 @@
+/*
+ * Lua <-> V8 bridge, proxy allocation site census.
+ * (C) Copyright 2014, Karel Tuma <kat@lua.cz>, All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NDEBUG
+#include <v8-debug.h>
+#else
+#include <v8.h>
+#endif
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LV8_CPP
+#include "lv8.hpp"
+#include "macros.hpp"
+
+using namespace v8;
+
+#if !NON_POSIX
+/*
+ * Notes on census:
+ *
+ * Opt-in (lv8.census(true)), costs nothing when off. Every proxy made
+ * while on gets an entry in a side table keyed by its lv8_object,
+ * pointing to an interned allocation site: innermost Lua source:line
+ * and JS script:line at the time. Entries are dropped when the proxy
+ * dies. lv8.census() aggregates live entries by site and type, with
+ * count and age, most numerous first. Sites live until census is off.
+ */
+#define CENSUS_BUCKETS 4096
+#define CENSUS_SITES 1024
+#define CENSUS_HASH(p) ((((uintptr_t)(p)) >> 4) % CENSUS_BUCKETS)
+
+struct census_site {
+  census_site *next; // Site list.
+  census_site *hnext; // Site hash chain.
+  int row[4]; // Aggregate row per LV8_OBJ_* type, lv8_census_push().
+  char name[1]; // "lua | js"
+};
+
+struct census_entry {
+  census_entry *next;
+  lv8_object *obj;
+  census_site *site;
+  double born;
+};
+
+/* Aggregate row. */
+struct census_row {
+  census_site *site;
+  int type;
+  unsigned long count;
+  double oldest, agesum;
+};
+
+int lv8_census_on;
+static census_entry *census_table[CENSUS_BUCKETS];
+static census_site *census_sites; // All sites, list.
+static census_site *census_shash[CENSUS_SITES];
+
+static double census_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Intern site string. */
+static census_site *census_intern(const char *s)
+{
+  unsigned h = 2166136261u;
+  for (const char *p = s; *p; p++)
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  census_site **b = &census_shash[h % CENSUS_SITES];
+  for (census_site *c = *b; c; c = c->hnext)
+    if (!strcmp(c->name, s))
+      return c;
+  census_site *c = (census_site*)malloc(sizeof(*c) + strlen(s));
+  strcpy(c->name, s);
+  c->hnext = *b;
+  *b = c;
+  c->next = census_sites;
+  census_sites = c;
+  return c;
+}
+
+/* Describe current allocation site. */
+static census_site *census_here(lua_State *L)
+{
+  char buf[512];
+  lua_Debug ar;
+  int n = 0;
+  buf[0] = 0;
+  for (int level = 0; lua_getstack(L, level, &ar); level++) {
+    lua_getinfo(L, "Sl", &ar);
+    if (ar.currentline > 0) { // Innermost Lua frame.
+      n = snprintf(buf, sizeof(buf), "%s:%d", ar.short_src, ar.currentline);
+      break;
+    }
+  }
+  if (!n)
+    n = snprintf(buf, sizeof(buf), "?");
+  HandleScope scope(ISOLATE);
+  Handle<StackTrace> st = StackTrace::CurrentStackTrace(ISOLATE, 1,
+      StackTrace::kOverview);
+  if (!st.IsEmpty() && st->GetFrameCount() > 0) {
+    Handle<StackFrame> f = st->GetFrame(0);
+    String::Utf8Value sn(f->GetScriptName());
+    snprintf(buf + n, sizeof(buf) - n, " | %s:%d", *sn ? *sn : "?",
+        f->GetLineNumber());
+  } else {
+    snprintf(buf + n, sizeof(buf) - n, " | -");
+  }
+  return census_intern(buf);
+}
+
+static census_entry *census_take(lv8_object *v)
+{
+  for (census_entry **p = &census_table[CENSUS_HASH(v)]; *p;
+      p = &(*p)->next) {
+    if ((*p)->obj == v) {
+      census_entry *e = *p;
+      *p = e->next;
+      return e;
+    }
+  }
+  return 0;
+}
+
+static void census_put(census_entry *e)
+{
+  census_entry **b = &census_table[CENSUS_HASH(e->obj)];
+  e->next = *b;
+  *b = e;
+}
+
+static int census_cmp(const void *a, const void *b)
+{
+  const census_row *x = (const census_row*)a, *y = (const census_row*)b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+//////////////////////////////// PUBLIC //////////////////////////////
+
+/* Record new proxy v made at current site. */
+void lv8_census_track(lua_State *L, lv8_object *v)
+{
+  free(census_take(v)); // Address reused, death went unnoticed.
+  census_entry *e = (census_entry*)malloc(sizeof(*e));
+  e->obj = v;
+  e->site = census_here(L);
+  e->born = census_clock();
+  census_put(e);
+}
+
+/* Proxy v died. */
+void lv8_census_forget(lv8_object *v)
+{
+  free(census_take(v));
+}
+
+/* Proxy moved from v to nv (lv8.escape). */
+void lv8_census_move(lv8_object *v, lv8_object *nv)
+{
+  census_entry *e = census_take(v);
+  if (e) {
+    e->obj = nv;
+    census_put(e);
+  }
+}
+
+/* Turn census on or off (dropping everything). */
+void lv8_census_enable(int on)
+{
+  lv8_census_on = on;
+  if (on)
+    return;
+  for (int i = 0; i < CENSUS_BUCKETS; i++) {
+    while (census_entry *e = census_table[i]) {
+      census_table[i] = e->next;
+      free(e);
+    }
+  }
+  while (census_site *c = census_sites) {
+    census_sites = c->next;
+    free(c);
+  }
+  memset(census_shash, 0, sizeof(census_shash));
+}
+
+/* Push array of {site, type, count, oldest, mean} rows. */
+void lv8_census_push(lua_State *L)
+{
+  static const char *const types[] = { "lua", "js", "context", "sandbox" };
+  int nrows = 0, max = 64;
+  census_row *rows = (census_row*)malloc(max * sizeof(*rows));
+  double now = census_clock();
+  for (census_site *c = census_sites; c; c = c->next)
+    memset(c->row, -1, sizeof(c->row));
+  for (int i = 0; i < CENSUS_BUCKETS; i++) {
+    for (census_entry *e = census_table[i]; e; e = e->next) {
+      int *slot = &e->site->row[e->obj->type & 3];
+      if (*slot < 0) {
+        if (nrows == max)
+          rows = (census_row*)realloc(rows, (max *= 2) * sizeof(*rows));
+        *slot = nrows++;
+        memset(&rows[*slot], 0, sizeof(*rows));
+        rows[*slot].site = e->site;
+        rows[*slot].type = e->obj->type;
+      }
+      census_row *r = &rows[*slot];
+      double age = now - e->born;
+      r->count++;
+      r->agesum += age;
+      if (age > r->oldest)
+        r->oldest = age;
+    }
+  }
+  qsort(rows, nrows, sizeof(*rows), census_cmp);
+  lua_createtable(L, nrows, 0);
+  for (int i = 0; i < nrows; i++) {
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, rows[i].site->name);
+    lua_setfield(L, -2, "site");
+    lua_pushstring(L, types[rows[i].type & 3]);
+    lua_setfield(L, -2, "type");
+    lua_pushnumber(L, rows[i].count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, rows[i].oldest);
+    lua_setfield(L, -2, "oldest");
+    lua_pushnumber(L, rows[i].agesum / rows[i].count);
+    lua_setfield(L, -2, "mean");
+    lua_rawseti(L, -2, i + 1);
+  }
+  free(rows);
+}
+#endif
@@ -27,6 +27,9 @@
 #include <v8.h>
 #endif
 #include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -49,15 +52,44 @@ using namespace v8;
 /* Default V8 engine flags. */
 #define LV8_DEFAULT_FLAGS "--harmony"
 #define LV8_IDENTITY "lv8::identity"
+#define LV8_GOPN "lv8::gopn" // Pristine Object.getOwnPropertyNames.
+
+/* cgroup v2 directory of this process (opt-in), see lv8.pressure(). */
+#define LV8_CGROUP_ENV "LV8_CGROUP"
+#define LV8_CGROUP_HEAP 50 // Default V8 old space, % of memory.max.
+#define LV8_PLATFORM_MAXCPUS 256 // lv8.platform{cpus=...}
+#define LV8_PERFMAP_ENV "LV8_PERFMAP" // "1" or "jitdump" at startup.
+
+/* lv8.json */
+#define LV8_JSON_EXTERNAL 65536 // Decode input this long is read in place.
+#define LV8_JSON_CHUNK 65536 // Streaming encoder piece size.
+#define LV8_JSON_DEPTH 1000 // Encoder nesting limit, catches cycles.
 
 /* Shortcut accessors. */
 #define UV_LIB lua_upvalueindex(1) // ORDER luaopen_lv8.
 #define UV_STATE lua_upvalueindex(2)
 #define UV_REFTAB lua_upvalueindex(3)
 #define UV_OBJMT lua_upvalueindex(4)
-#define UV_CTXMT lua_upvalueindex(5)
+#define UV_BUFMT lua_upvalueindex(5)
+#define UV_STRMT lua_upvalueindex(6)
+#define UV_REMT lua_upvalueindex(7)
+#define N_UV 7
 #define LV8_STATE ((lv8_state*)lua_touserdata(L, UV_STATE))
 
+/* Profiler crossing mark, until end of scope. */
+#if !NON_POSIX
+#define LV8_PROF_CROSS(L, kind) lv8_prof_guard prof_cross_(L, kind)
+#else
+#define LV8_PROF_CROSS(L, kind)
+#endif
+
+/* Proxy census hook, only when lv8.census() is on. */
+#if !NON_POSIX
+#define LV8_CENSUS(call) do { if (lv8_census_on) lv8_census_##call; } while (0)
+#else
+#define LV8_CENSUS(call) do {} while (0)
+#endif
+
 /* Shortcut template accessors. */
 #define PROXY Local<FunctionTemplate>::New(ISOLATE, LV8_STATE->proxy)
 #define GLOBAL Local<ObjectTemplate>::New(ISOLATE, LV8_STATE->gtpl)
@@ -145,43 +177,140 @@ static void persistent_del(lua_State *L, lv8_object *v)
   lua_rawset(L, UV_REFTAB); // Clear JS -> Lua.
 }
 
+/*
+ * Weak callbacks run inside the V8 GC pause, so they only reset the
+ * handles and push the dead object onto a lock-free stack. The Lua side
+ * (reftab unmapping, freeing) is done later at safe points by
+ * gc_drain(), at most 'max' objects per call. Lua proxies of objects
+ * waiting there have an empty handle (see convert_lua2js). Other native
+ * state owned by weak handles (lv8.fn, binding compile jobs) is queued
+ * as lv8_deferred and released there as well.
+ */
+#define LV8_GC_BATCH 256
+
+/* Push onto lock-free stack at *head, linked through 'link'. */
+#define DEAD_PUSH(head, v, link) do { \
+  __typeof__(v) h_; \
+  do { \
+    h_ = *(head); \
+    (v)->link = h_; \
+  } while (!__sync_bool_compare_and_swap((head), h_, (v))); \
+} while (0)
+
 /* Context which was made weak by obj_gc is collected. */
 static void
-js_weak_context(const WeakCallbackData<Context, lua_State> &data)
+js_weak_context(const WeakCallbackData<Context, lv8_state> &data)
 {
   HandleScope scope(ISOLATE);
   Handle<Object> o = data.GetValue()->Global()->GetPrototype()->ToObject();
   lv8_context *v = (lv8_context*)o->GetAlignedPointerFromInternalField(0);
-  lua_State *L = data.GetParameter();
-
-  lv8_push(L, v);// Remove anchor if there is one.
-  lua_pushnil(L);
-  lua_rawset(L, UV_REFTAB);
 
+  v->checkpoint.Reset();
   v->context.Reset(); // This should trigger object collection below
   v->object.Reset();
   v->jscollected = 1;
+  DEAD_PUSH(&data.GetParameter()->deadctx, v, cnext); // Unanchor later.
 }
 
-/* Last reference to Lua object from JS died. Remove refs on Lua side. */
+/* Last reference to Lua object from JS died. Queue removal of refs. */
 static void
-js_weak_object(const WeakCallbackData<v8::Object, lua_State> &data)
+js_weak_object(const WeakCallbackData<v8::Object, lv8_state> &data)
 {
-  HandleScope scope(ISOLATE);
-  Handle<Object> o = data.GetValue();
-  lv8_object *v;
-  lua_State *L = data.GetParameter();
-  v = (lv8_object*)o->GetAlignedPointerFromInternalField(0);
+  lv8_object *v = (lv8_object*)
+    data.GetValue()->GetAlignedPointerFromInternalField(0);
+  v->object.Reset(); // Kill Persistent<>.
+  DEAD_PUSH(&data.GetParameter()->dead, v, qnext);
+}
+
+/*
+ * Lua string read by V8 in place (lv8.json.decode(), lv8.regex). It
+ * stays anchored in the registry until V8 disposes of the JS string,
+ * which may be at any GC, so the anchor is dropped at the next safepoint.
+ */
+class lv8_extstr : public String::ExternalOneByteStringResource {
+  public:
+  lv8_extstr(lv8_state *s, const char *p, size_t n, int r)
+    : next(0), ref(r), state(s), ptr(p), len(n) {}
+  virtual const char *data() const { return ptr; }
+  virtual size_t length() const { return len; }
+  lv8_extstr *next; // Dead queue link.
+  int ref; // Registry anchor of the Lua string.
+  protected:
+  virtual void Dispose() { DEAD_PUSH(&state->deadext, this, next); }
+  private:
+  lv8_state *state;
+  const char *ptr;
+  size_t len;
+};
 
+/* Release Lua side of dead object. */
+static void gc_release(lua_State *L, lv8_object *v)
+{
   /* INVARIANT #3 */
-  persistent_lookup_js(L, (lv8_object*)v); // Lookup Lua object.
-  assert(!lua_isnil(L, -1)); // Must be tracked.
-  persistent_del(L, v);
+  if (persistent_lookup_js(L, v)) // Unless remapped meanwhile.
+    persistent_del(L, v);
+  else
+    lua_pop(L, 1);
+  LV8_CENSUS(forget(v));
+  if (v->type == LV8_OBJ_LUA && !v->scoped) // Proxies for Lua are not GC managed.
+    delete v;
+}
 
-  v->object.Reset(); // Kill Persistent<>.
+/* Process up to max (all if < 0) dead objects, returns count. */
+static int gc_drain(lua_State *L, int max)
+{
+  lv8_state *state = LV8_STATE;
+  int n = 0;
+  /* Unanchor external strings, cheap and not counted. */
+  lv8_extstr *src = __sync_lock_test_and_set(&state->deadext,
+      (lv8_extstr*)0);
+  while (lv8_extstr *s = src) {
+    src = s->next;
+    luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+    delete s;
+  }
+  /* Native releases, those not ready yet wait for another round. */
+  lv8_deferred *d = __sync_lock_test_and_set(&state->deferred,
+      (lv8_deferred*)0);
+  while (lv8_deferred *x = d) {
+    d = x->dnext;
+    if (!x->release(L, x))
+      DEAD_PUSH(&state->deferred, x, dnext);
+  }
+  /* Objects first, context anchors may keep their memory alive. */
+  for (;;) {
+    if (!state->backlog)
+      state->backlog = __sync_lock_test_and_set(&state->dead, (lv8_object*)0);
+    if (!state->backlog || n == max)
+      break;
+    lv8_object *v = state->backlog;
+    state->backlog = v->qnext;
+    gc_release(L, v);
+    n++;
+  }
+  while (n != max && !state->backlog) {
+    if (!state->ctxbacklog)
+      state->ctxbacklog =
+        __sync_lock_test_and_set(&state->deadctx, (lv8_context*)0);
+    if (!state->ctxbacklog)
+      break;
+    lv8_context *v = state->ctxbacklog;
+    state->ctxbacklog = v->cnext;
+    lv8_push(L, v); // Remove anchor if there is one.
+    lua_pushnil(L);
+    lua_rawset(L, UV_REFTAB);
+    n++;
+  }
+  return n;
+}
 
-  if (v->type == LV8_OBJ_LUA) // Proxies for Lua are not GC managed.
-    delete v;
+/* Cheap check at bridge crossings. */
+static inline void gc_safepoint(lua_State *L)
+{
+  lv8_state *state = LV8_STATE;
+  if (state->dead || state->backlog || state->deadctx || state->ctxbacklog ||
+      state->deadext || state->deferred)
+    gc_drain(L, LV8_GC_BATCH);
 }
 
 /* Restart finalizer on Lua 5.2/5.3. */
@@ -213,7 +342,8 @@ static int lua_obj_gc(lua_State *L)
       lua_pushvalue(L, UV_OBJMT); // Restarts finalizer.
       lua_setmetatable(L, 1);
 
-      o->context.SetWeak(L, js_weak_context);
+      o->context.SetWeak(LV8_STATE, js_weak_context);
+      o->checkpoint.Reset(); // Would pin the context otherwise.
 
       lua_pushvalue(L, 1); // Anchor key.
       lua_pushboolean(L, 1); // Can be anything.
@@ -226,11 +356,22 @@ static int lua_obj_gc(lua_State *L)
     assert(o->type == LV8_OBJ_JS);
     OREF(o)->SetHiddenValue(LITERAL(LV8_IDENTITY),
       Undefined(ISOLATE));
+    LV8_CENSUS(forget(o));
   }
   o->object.Reset();
   return 0;
 }
 
+static Handle<ArrayBuffer> buffer_js(lv8_buffer *b);
+static lv8_object *scope_alloc(lua_State *L, lv8_scope *sc);
+/* lv8.layout() of userdata metatable. */
+struct lv8_layout {
+  size_t size; // Minimum userdata size.
+  Persistent<FunctionTemplate> tpl;
+  Persistent<Object> fields; // name -> LT_FIELD().
+};
+static lv8_layout *layout_find(lua_State *L, int idx);
+
 /* Convert Lua value to JS counterpart. */
 static Handle<Value> convert_lua2js(lua_State *L, int idx)
 {
@@ -251,26 +392,60 @@ static Handle<Value> convert_lua2js(lua_State *L, int idx)
       return ESCAPE(UTF8(p, String::kNormalString, (int)n));
     }
   }
-  lv8_object *wrapper = lv8_unwrap_lua(L, idx);
+  lv8_object *wrapper = 0;
+  if (lua_getmetatable(L, idx)) { // Our own userdata?
+    if (lua_rawequal(L, -1, UV_OBJMT)) {
+      wrapper = (lv8_object*)lua_touserdata(L, idx);
+    } else if (lua_rawequal(L, -1, UV_BUFMT)) {
+      lua_pop(L, 1);
+      return ESCAPE(buffer_js((lv8_buffer*)lua_touserdata(L, idx)));
+    } else if (lua_rawequal(L, -1, UV_STRMT)) {
+      lua_pop(L, 1);
+      return scope.Escape(Local<String>::New(ISOLATE,
+            ((lv8_jsstring*)lua_touserdata(L, idx))->str));
+    }
+    lua_pop(L, 1);
+  }
   if (!wrapper) {
     wrapper = persistent_lookup_lua(L, idx);
+    if (wrapper && wrapper->object.IsEmpty()) { // Dead, not drained yet.
+      persistent_lookup_js(L, wrapper);
+      persistent_del(L, wrapper); // gc_drain() will only free it.
+      wrapper = 0;
+    }
     if (!wrapper) { // Mapping does not exist yet.
-      wrapper = new lv8_object();
-      memset(wrapper, 0, sizeof(*wrapper));
-      wrapper->type = LV8_OBJ_LUA;
+      lv8_scope *sc = LV8_STATE->scope;
+      wrapper = sc ? scope_alloc(L, sc) : new lv8_object();
       /* No metatable needed, this value is never user-visible. */
       if (!wrapper) return ESCAPE(Undefined(ISOLATE));
       memset(wrapper, 0, sizeof(*wrapper));
-      Handle<Object> no = PROXY->InstanceTemplate()->NewInstance();
+      wrapper->type = LV8_OBJ_LUA;
+      wrapper->scoped = !!sc;
+      lv8_layout *lt = lua_type(L, idx) == LUA_TUSERDATA ?
+        layout_find(L, idx) : 0;
+      Handle<Object> no = (lt ? REF(FunctionTemplate, lt->tpl) : PROXY)
+        ->InstanceTemplate()->NewInstance();
       wrapper->object.Reset(ISOLATE, no); // Anchor proxy in JS
       persistent_add(L, idx, wrapper); // Anchor Persistent<> UD in Lua
       no->SetAlignedPointerInInternalField(0, (void*)wrapper);
-      wrapper->object.SetWeak(L, js_weak_object);
+      if (lt) { // Direct field access.
+        no->SetAlignedPointerInInternalField(1, lua_touserdata(L, idx));
+        no->SetAlignedPointerInInternalField(2, (void*)lt);
+      }
+      wrapper->object.SetWeak(LV8_STATE, js_weak_object);
+      LV8_CENSUS(track(L, wrapper));
     }
   }
   return scope.Escape(Local<Object>::New(ISOLATE, wrapper->object));
 }
 
+/* Push JS string as Lua string, never lazy (table keys). */
+static void push_string(lua_State *L, const Handle<Value> &v)
+{
+  String::Utf8Value str(v);
+  lua_pushlstring(L, *str, str.length());
+}
+
 /* Convert JS value to Lua counterpart. */
 static void convert_js2lua(lua_State *L, const Handle<Value> &v,
     bool sb_extract = 0)
@@ -283,13 +458,25 @@ static void convert_js2lua(lua_State *L, const Handle<Value> &v,
   } else if (v->IsNumber() || v->IsNumberObject()) {
     lua_pushnumber(L, v->NumberValue());
   } else if (v->IsString() || v->IsStringObject()) {
-    String::Utf8Value str(v);
-    lua_pushlstring(L, *str, str.length());
+    uint32_t lazy = LV8_STATE->lazystr;
+    if (lazy && v->IsString() && (uint32_t)v.As<String>()->Length() >= lazy) {
+      lv8_jsstring *s = (lv8_jsstring*)lua_newuserdata(L, sizeof(*s));
+      memset(s, 0, sizeof(*s));
+      s->str.Reset(ISOLATE, v.As<String>());
+      lua_pushvalue(L, UV_STRMT);
+      lua_setmetatable(L, -2);
+    } else {
+      push_string(L, v);
+    }
   } else { // Must be some sort of other object.
     assert(v->IsObject());
     Handle<Object> o = v->ToObject();
     lv8_context *c;
     if ((c = lv8_unwrap_js(L, o))) { // (LIKELY) Proxied?
+      if (c == LV8_DEAD_PROXY) { // Invalidated by lv8.scope() exit.
+        lua_pushnil(L);
+        return;
+      }
       if (c->type == LV8_OBJ_LUA) {
         persistent_lookup_js(L, c);
         return; // Return native Lua object.
@@ -324,8 +511,28 @@ static void convert_js2lua(lua_State *L, const Handle<Value> &v,
 }
 
 static void checkstate(lua_State *L);
+
+/* Main thread of L, outlives any coroutine which might be calling. */
+static lua_State *main_thread(lua_State *L)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  lua_State *m = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  return m;
+}
+
+/* Push fn as closure sharing our upvalues. */
+static void pushcclosure_uv(lua_State *L, lua_CFunction fn)
+{
+  for (int i = 1; i <= N_UV; i++)
+    lua_pushvalue(L, lua_upvalueindex(i));
+  lua_pushcclosure(L, fn, N_UV);
+}
+
 /* Common context header. */
 #define CB_LUA_COMMON \
+  gc_safepoint(L); \
+  LV8_PROF_CROSS(L, LV8_CROSS_LUA2JS); \
   HandleScope scope(ISOLATE); \
   lv8_object *p = (lv8_object*)lua_touserdata(L, 1); \
   Handle<Object> o = OREF(p); \
@@ -463,7 +670,7 @@ static int lua_obj_ipairs(lua_State *L)
     if (!o->IsArray()) {
       err = 1;
     } else {
-      lua_pushcfunction(L, js_array_ipairs_aux);
+      pushcclosure_uv(L, js_array_ipairs_aux); // Converts values.
       lua_pushvalue(L, 1);
       lua_pushnil(L);
       return 3;
@@ -497,7 +704,7 @@ static int lua_obj_pairs(lua_State *L)
         propname->IsUndefined() ||
         propname->IsNull())
       continue;
-    convert_js2lua(L, propname); // Key.
+    push_string(L, propname); // Key.
     convert_js2lua(L, o->Get(propname)); // Val.
     lua_rawset(L, -3); // Set t[key] = val.
   }
@@ -515,6 +722,152 @@ static int lua_obj_len(lua_State *L)
   return 1;
 }
 
+/*
+ * lv8.iter(o [, batch]) walks JS iterables (Map, Set, generators, or
+ * anything with [Symbol.iterator]() or next()) in generic for. Values
+ * are pulled 'batch' at a time by a per-context JS helper, so there is
+ * a single crossing per batch rather than per element. Maps yield
+ * key, value; everything else yields counter, value like ipairs().
+ * A null or undefined Map key would end the loop as nil, it is yielded
+ * as lv8.json.null instead.
+ */
+#define LV8_ITER "lv8::iter"
+#define LV8_ITER_BATCH 64
+static const char lv8_iter_src[] =
+  "(function(o, n) {"
+  "  var it, kv = 0;"
+  "  if (typeof Map == 'function' && o instanceof Map) {"
+  "    it = o.entries(); kv = 1;"
+  "  } else if (typeof Set == 'function' && o instanceof Set) {"
+  "    it = o.values();"
+  "  } else if (typeof Symbol == 'function' && Symbol.iterator &&"
+  "      typeof o[Symbol.iterator] == 'function') {"
+  "    it = o[Symbol.iterator]();"
+  "  } else if (typeof o.next == 'function') {"
+  "    it = o;"
+  "  } else throw new TypeError('object is not iterable');"
+  "  return function() {"
+  "    var out = [], r;"
+  "    out.kv = kv;"
+  "    for (var i = 0; i < n; i++) {"
+  "      if ((r = it.next()).done) { out.done = true; break; }"
+  "      if (kv) out.push(r.value[0], r.value[1]); else out.push(r.value);"
+  "    }"
+  "    return out;"
+  "  };"
+  "})";
+
+/* Iterator state field indices, buffered values follow. */
+enum { ITER_FN = 1, ITER_POS, ITER_N, ITER_KV, ITER_DONE, ITER_BUF };
+
+/* Refill state buffer from the JS side. Returns false on exception. */
+static bool iter_fill(lua_State *L, int st)
+{
+  lua_rawgeti(L, st, ITER_FN);
+  HandleScope scope(ISOLATE);
+  lv8_object *p = (lv8_object*)lua_touserdata(L, -1);
+  Handle<Object> fn = OREF(p);
+  Handle<Context> ctx = fn->CreationContext();
+  ctx->Enter();
+  TryCatch exc;
+  Handle<Value> res = fn->CallAsFunction(ctx->Global(), 0, 0);
+  bool caught = do_exc(L, exc);
+  if (!caught) {
+    Handle<Array> a = Handle<Array>::Cast(res);
+    uint32_t n = a->Length();
+    for (uint32_t i = 0; i < n; i++) {
+      convert_js2lua(L, a->Get(i));
+      lua_rawseti(L, st, ITER_BUF + i);
+    }
+    lua_pushinteger(L, n);
+    lua_rawseti(L, st, ITER_N);
+    lua_pushinteger(L, 0);
+    lua_rawseti(L, st, ITER_POS);
+    lua_pushboolean(L, a->Get(LITERAL("kv"))->BooleanValue());
+    lua_rawseti(L, st, ITER_KV);
+    lua_pushboolean(L, a->Get(LITERAL("done"))->BooleanValue());
+    lua_rawseti(L, st, ITER_DONE);
+  }
+  ctx->Exit();
+  return !caught;
+}
+
+/* Generic for step. */
+static int js_iter_aux(lua_State *L)
+{
+  lua_settop(L, 2);
+  lua_rawgeti(L, 1, ITER_POS);
+  lua_Integer pos = lua_tointeger(L, -1);
+  lua_rawgeti(L, 1, ITER_N);
+  lua_Integer n = lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  if (pos >= n) {
+    lua_rawgeti(L, 1, ITER_DONE);
+    bool done = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (done)
+      return 0;
+    if (!iter_fill(L, 1))
+      lua_error(L); // Error object already on stack.
+    lua_pop(L, 1); // Batch function.
+    lua_rawgeti(L, 1, ITER_N);
+    if (!(n = lua_tointeger(L, -1)))
+      return 0;
+    lua_pop(L, 1);
+    pos = 0;
+  }
+  lua_rawgeti(L, 1, ITER_KV);
+  bool kv = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (kv) {
+    lua_rawgeti(L, 1, ITER_BUF + pos++);
+    if (lua_isnil(L, -1)) { // Not the end, null key.
+      lua_pop(L, 1);
+      lua_pushlightuserdata(L, 0); // lv8.json.null
+    }
+  } else {
+    lua_pushinteger(L, lua_tointeger(L, 2) + 1);
+  }
+  lua_rawgeti(L, 1, ITER_BUF + pos++);
+  lua_pushinteger(L, pos);
+  lua_rawseti(L, 1, ITER_POS);
+  return 2;
+}
+
+/* lv8.iter(o [, batch]) -> aux, state, 0 */
+static int lua_obj_iter(lua_State *L)
+{
+  int caught = 0;
+  int batch = luaL_optinteger(L, 2, LV8_ITER_BATCH);
+  luaL_argcheck(L, batch > 0, 2, "batch size must be positive");
+  lv8_object *p = lv8_unwrap_lua(L, 1);
+  luaL_argcheck(L, p && p->type == LV8_OBJ_JS, 1, "JS object expected");
+  {
+    CB_LUA_COMMON;
+    Handle<Object> gl = ctx->Global();
+    Handle<String> key = LITERAL(LV8_ITER);
+    Handle<Value> helper = gl->GetHiddenValue(key);
+    TryCatch exc;
+    if (helper.IsEmpty()) { // Compiled once per context.
+      helper = Script::Compile(LITERAL(lv8_iter_src))->Run();
+      gl->SetHiddenValue(key, helper);
+    }
+    Handle<Value> argv[2] = { o, Int32::New(ISOLATE, batch) };
+    Handle<Value> fn = helper->ToObject()->CallAsFunction(gl, 2, argv);
+    if (!(caught = do_exc(L, exc))) {
+      pushcclosure_uv(L, js_iter_aux);
+      lua_createtable(L, ITER_BUF + batch, 0); // State.
+      convert_js2lua(L, fn);
+      lua_rawseti(L, -2, ITER_FN);
+      lua_pushinteger(L, 0);
+    }
+    ctx->Exit();
+  }
+  if (caught)
+    lua_error(L);
+  return 3;
+}
+
 /* Protected settable. */
 static int settab_aux(lua_State *L)
 {
@@ -547,6 +900,7 @@ static void gettab(lua_State *L)
  */
 static bool exception(lua_State *L, int narg, int nret)
 {
+  LV8_PROF_CROSS(L, LV8_CROSS_JS2LUA);
   if (lua_pcall(L, narg, nret, 0) == LUA_OK) {
     return false;
   }
@@ -555,11 +909,22 @@ static bool exception(lua_State *L, int narg, int nret)
   return true;
 }
 
+/* Throw if holder is a proxy invalidated by lv8.scope() exit. */
+static bool proxy_dead(Handle<Object> holder)
+{
+  if (holder->GetAlignedPointerFromInternalField(0))
+    return false;
+  THROW("Lua proxy used after its lv8.scope() exited");
+  return true;
+}
+
 /* Get holder[idx]. */
 static void lv8_getidx_cb(uint32_t idx,
     const PropertyCallbackInfo<Value> &info)
 {
   UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
   gettab(L);
   convert_js2lua(L, info.Holder(), true);
   lua_pushnumber(L, idx);
@@ -576,6 +941,8 @@ static void lv8_setidx_cb(uint32_t idx, Local<Value> val,
     const PropertyCallbackInfo<Value> &info)
 {
   UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
   settab(L);
   convert_js2lua(L, info.Holder(), true);
   lua_pushnumber(L, idx);
@@ -592,6 +959,8 @@ static void lv8_delidx_cb(uint32_t idx,
     const PropertyCallbackInfo<Boolean> &info)
 {
   UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
   settab(L);
   convert_js2lua(L, info.Holder(), true);
   lua_pushnumber(L, idx);
@@ -603,18 +972,95 @@ static void lv8_delidx_cb(uint32_t idx,
   info.GetReturnValue().Set(Boolean::New(ISOLATE, true));
 }
 
+/*
+ * Sandboxes created with lv8.sandbox(t, true) cache converted globals
+ * on the JS side, in a hidden object on the sandbox global. Entries are
+ * [value, generation] pairs. Generation of each key is kept in
+ * LV8_STATE->sbgen and bumped by named writes through any proxy (the
+ * table may be reachable from elsewhere, eg. env.self) once a caching
+ * sandbox exists, and by lv8.touch(t, key); lv8.touch(t) flushes all
+ * caches via sbepoch. Keys are not told apart by table, a spurious
+ * bump costs one miss. Indexed writes never hit cached names.
+ */
+#define LV8_SBCACHE "lv8::sbcache"
+
+/* Holder is global of caching sandbox? */
+static lv8_context *sandbox_cached(Handle<Object> holder)
+{
+  lv8_context *c = (lv8_context*)holder->GetAlignedPointerFromInternalField(0);
+  if (c && c->type == LV8_OBJ_SB && c->cached)
+    return c;
+  return 0;
+}
+
+/* Get cache object of sandbox global, empty handle if not caching. */
+static Handle<Object> sandbox_cache(lua_State *L, Handle<Object> holder)
+{
+  lv8_context *c = sandbox_cached(holder);
+  if (!c)
+    return Handle<Object>();
+  Handle<String> key = LITERAL(LV8_SBCACHE);
+  Handle<Value> cache = holder->GetHiddenValue(key);
+  if (cache.IsEmpty() || c->epoch != LV8_STATE->sbepoch) { // Flushed.
+    Handle<Object> o = Object::New(ISOLATE);
+    o->SetPrototype(Null(ISOLATE));
+    holder->SetHiddenValue(key, o);
+    c->epoch = LV8_STATE->sbepoch;
+    return o;
+  }
+  return cache.As<Object>();
+}
+
+/* Current generation of cached key. */
+static int32_t sandbox_gen(lua_State *L, Handle<String> prop)
+{
+  Handle<Value> g = REF(Object, LV8_STATE->sbgen)->GetRealNamedProperty(prop);
+  return g.IsEmpty() ? 0 : g->Int32Value();
+}
+
+/* Invalidate key in all sandbox caches. */
+static void sandbox_bump(lua_State *L, Handle<String> prop)
+{
+  if (!LV8_STATE->sbcaching)
+    return; // Nothing cached.
+  REF(Object, LV8_STATE->sbgen)->ForceSet(prop,
+      Int32::New(ISOLATE, sandbox_gen(L, prop) + 1));
+}
+
 /* Get holder.prop. */
 static void lv8_getprop_cb(Local<String> prop,
     const PropertyCallbackInfo<Value> &info)
 {
   UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
+  Handle<Object> cache = sandbox_cache(L, info.Holder());
+  int32_t gen = 0;
+  if (!cache.IsEmpty()) { // Try cached global first.
+    gen = sandbox_gen(L, prop);
+    Handle<Value> e = cache->GetRealNamedProperty(prop);
+    if (!e.IsEmpty()) {
+      Handle<Array> a = e.As<Array>();
+      if (a->Get(1)->Int32Value() == gen) {
+        info.GetReturnValue().Set(a->Get(0));
+        return;
+      }
+    }
+  }
   gettab(L);
   convert_js2lua(L, info.Holder(), true);
-  convert_js2lua(L, prop);
+  push_string(L, prop);
   if (exception(L, 2, 1))
     return;
-  info.GetReturnValue().Set(convert_lua2js(L, -1));
-  lua_pop(L, -1);
+  Handle<Value> res = convert_lua2js(L, -1);
+  if (!cache.IsEmpty() && !res->IsUndefined()) {
+    Handle<Array> e = Array::New(ISOLATE, 2);
+    e->Set(0, res);
+    e->Set(1, Int32::New(ISOLATE, gen));
+    cache->ForceSet(prop, e);
+  }
+  info.GetReturnValue().Set(res);
+  lua_pop(L, 1);
 }
 
 /* Set holder.prop = val. */
@@ -622,9 +1068,12 @@ static void lv8_setprop_cb(Local<String> prop, Local<Value> val,
     const PropertyCallbackInfo<Value> &info)
 {
   UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
+  sandbox_bump(L, prop); // Write-through invalidation.
   settab(L);
   convert_js2lua(L, info.Holder(), true);
-  convert_js2lua(L, prop);
+  push_string(L, prop);
   convert_js2lua(L, val);
   if (exception(L, 3, 0))
     info.GetReturnValue().Set(Undefined(ISOLATE));
@@ -635,34 +1084,83 @@ static void lv8_delprop_cb(Local<String> prop,
     const PropertyCallbackInfo<Boolean> &info)
 {
   UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
+  sandbox_bump(L, prop);
   settab(L);
   convert_js2lua(L, info.Holder(), true);
-  convert_js2lua(L, prop);
+  push_string(L, prop);
   lua_pushnil(L);
   if (exception(L, 3, 0))
     info.GetReturnValue().Set(Boolean::New(ISOLATE,false));
   info.GetReturnValue().Set(Boolean::New(ISOLATE, true));
 }
 
-/* Enumerate both array and hash. */
+/* Enumerate array part, 1..#t (indices map to Lua keys as-is). */
+static void lv8_enumidx_cb(const PropertyCallbackInfo<Array> &info)
+{
+  HandleScope scope(ISOLATE);
+  UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
+  convert_js2lua(L, info.Holder(), true); // Load table
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return; // Named enumerator will complain.
+  }
+  uint32_t n = lua_rawlen(L, -1);
+  lua_pop(L, 1);
+  Handle<Array> a = Array::New(ISOLATE, n); // Presized, filled in order.
+  for (uint32_t i = 0; i < n; i++)
+    a->Set(i, Integer::NewFromUnsigned(ISOLATE, i + 1));
+  info.GetReturnValue().Set(a);
+}
+
+/* Enumerate hash part (everything indexed enumerator did not cover). */
 static void lv8_enumprop_cb(const PropertyCallbackInfo<Array> &info)
 {
   HandleScope scope(ISOLATE);
   UNWRAP_L;
+  if (proxy_dead(info.Holder()))
+    return;
   convert_js2lua(L, info.Holder(), true); // Load table
   if (!lua_istable(L, -1)) {
     lua_pop(L, 1);
     ISOLATE->ThrowException(LITERAL("Only lua tables can be enumerated"));
+    return;
   }
-  uint32_t i, n = 0; // Slower: lua_rawlen(L -1);
-  Handle<Array> a = Array::New(ISOLATE, n);
-  i = 0;
+  lua_Number alen = lua_rawlen(L, -1);
+  /* Collect keys first so that the array is allocated once, presized. */
+  Local<Value> fixed[64], *keys = fixed;
+  uint32_t n = 0, max = sizeof(fixed)/sizeof(fixed[0]);
   lua_pushnil(L); // First key.
-  for (i = 0; lua_next(L, -2); i++) {
-    a->Set(i, convert_lua2js(L, -2)); // Set key.
+  while (lua_next(L, -2)) {
     lua_pop(L, 1); // Pop value.
+    int t = lua_type(L, -1);
+    if (t == LUA_TNUMBER) {
+      lua_Number k = lua_tonumber(L, -1);
+      if (k >= 1 && k <= alen && k == (lua_Number)(uint32_t)k)
+        continue; // Covered by lv8_enumidx_cb.
+    } else if (t != LUA_TSTRING) {
+      continue; // Not usable as property name.
+    }
+    if (n == max) { // Spill to heap.
+      max *= 2;
+      Local<Value> *nk = new Local<Value>[max];
+      for (uint32_t i = 0; i < n; i++)
+        nk[i] = keys[i];
+      if (keys != fixed)
+        delete[] keys;
+      keys = nk;
+    }
+    keys[n++] = Local<Value>::New(ISOLATE, convert_lua2js(L, -1));
   }
   lua_pop(L, 1); // Pop table.
+  Handle<Array> a = Array::New(ISOLATE, n);
+  for (uint32_t i = 0; i < n; i++)
+    a->Set(i, keys[i]);
+  if (keys != fixed)
+    delete[] keys;
   info.GetReturnValue().Set(a);
 }
 
@@ -675,8 +1173,12 @@ static void lv8_js2lua_call(const v8::FunctionCallbackInfo<Value> &info)
   int argc = info.Length();
   int top = lua_gettop(L);
 
-  persistent_lookup_js(L,
-      (lv8_object*)self->GetAlignedPointerFromInternalField(0));
+  lv8_object *w = (lv8_object*)self->GetAlignedPointerFromInternalField(0);
+  if (!w) {
+    THROW("Lua function used past its lv8.scope()");
+    return;
+  }
+  persistent_lookup_js(L, w);
   assert(!lua_isnil(L, -1)); // Look up the actual Lua object.
 
   for (int i = 0; i < argc; i++) // Convert input args.
@@ -695,6 +1197,248 @@ static void lv8_js2lua_call(const v8::FunctionCallbackInfo<Value> &info)
   lua_pop(L, nres);
 }
 
+/*
+ * Typed exports, lv8.fn(f, "ddi>d"). Argument codes are d (number),
+ * i (integer), s (string), b (boolean) and v (any, generic conversion),
+ * optionally followed by '>' and a single result code of the same set.
+ * Stubs are instantiated per arity (up to LV8_FN_ARITY, beyond that the
+ * count is read at runtime) and result type, arguments are coerced
+ * straight to the Lua stack and the result is returned unboxed, as
+ * opposed to the argument ladder and result Array of lv8_js2lua_call.
+ * Returns JS function (made in the utility context) as proxy.
+ */
+#define LV8_FN_ARITY 4
+#define LV8_FN_MAXARGS 16
+static const char fn_types[] = "disbv";
+
+struct lv8_fn : lv8_deferred {
+  lv8_state *state;
+  lua_State *L;
+  int ref; // Lua function in registry.
+  int argc;
+  char args[LV8_FN_MAXARGS];
+  Persistent<Function> fn;
+};
+
+/* Push JS argument coerced to type t. */
+static inline void fn_arg(lua_State *L, char t, const Local<Value> &v)
+{
+  switch (t) {
+    case 'd': lua_pushnumber(L, v->NumberValue()); break;
+    case 'i': lua_pushinteger(L, v->IntegerValue()); break;
+    case 'b': lua_pushboolean(L, v->BooleanValue()); break;
+    case 's': push_string(L, v); break;
+    default: convert_js2lua(L, v);
+  }
+}
+
+template <int N, char R>
+static void fn_stub(const v8::FunctionCallbackInfo<Value> &info)
+{
+  HandleScope scope(ISOLATE);
+  lv8_fn *f = (lv8_fn*)External::Cast(*info.Data())->Value();
+  lua_State *L = f->L;
+  int argc = N < 0 ? f->argc : N;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, f->ref);
+  for (int i = 0; i < argc; i++)
+    fn_arg(L, f->args[i], info[i]);
+  if (exception(L, argc, R ? 1 : 0))
+    return; // Propagate exception.
+  switch (R) {
+    case 0: return;
+    case 'd': info.GetReturnValue().Set(lua_tonumber(L, -1)); break;
+    case 'i': {
+      lua_Integer n = lua_tointeger(L, -1);
+      if (n == (int32_t)n)
+        info.GetReturnValue().Set((int32_t)n);
+      else
+        info.GetReturnValue().Set((double)n);
+      break;
+    }
+    case 'b': info.GetReturnValue().Set((bool)lua_toboolean(L, -1)); break;
+    case 's': {
+      size_t n;
+      const char *s = lua_tolstring(L, -1, &n);
+      if (s)
+        info.GetReturnValue().Set(UTF8(s, String::kNormalString, (int)n));
+      break;
+    }
+    default: info.GetReturnValue().Set(convert_lua2js(L, -1));
+  }
+  lua_pop(L, 1);
+}
+
+#define FN_STUBS(N) { fn_stub<N, 0>, fn_stub<N, 'd'>, fn_stub<N, 'i'>, \
+  fn_stub<N, 's'>, fn_stub<N, 'b'>, fn_stub<N, 'v'> }
+static const FunctionCallback fn_stubs[LV8_FN_ARITY + 2][6] = {
+  FN_STUBS(0), FN_STUBS(1), FN_STUBS(2), FN_STUBS(3), FN_STUBS(4),
+  FN_STUBS(-1)
+};
+
+static void fn_weak_callback(const WeakCallbackData<Function, lv8_fn> &data)
+{
+  lv8_fn *f = data.GetParameter();
+  f->fn.Reset();
+  lv8_defer(f->state, f); // Unref outside of GC.
+}
+
+/* Deferred part of fn_weak_callback. */
+static bool fn_release(lua_State *L, lv8_deferred *d)
+{
+  lv8_fn *f = (lv8_fn*)d;
+  if (L)
+    luaL_unref(f->L, LUA_REGISTRYINDEX, f->ref);
+  delete f;
+  return true;
+}
+
+/* lv8.fn(f, sig) -> JS function */
+static int lua_fn(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  const char *sig = luaL_checkstring(L, 2);
+  const char *res = strchr(sig, '>');
+  int argc = res ? res - sig : strlen(sig);
+  int rtype = 0;
+  luaL_argcheck(L, argc <= LV8_FN_MAXARGS, 2, "too many arguments");
+  for (int i = 0; i < argc; i++)
+    luaL_argcheck(L, strchr(fn_types, sig[i]) && sig[i], 2,
+        "invalid argument type");
+  if (res && res[1]) {
+    luaL_argcheck(L, strchr(fn_types, res[1]) && !res[2], 2,
+        "invalid result type");
+    rtype = strchr(fn_types, res[1]) - fn_types + 1;
+  }
+  checkstate(L);
+
+  lv8_fn *f = new lv8_fn();
+  memset(f, 0, sizeof(*f));
+  f->release = fn_release;
+  f->state = LV8_STATE;
+  f->L = main_thread(L); // Calling coroutine may be gone by then.
+  f->argc = argc;
+  memcpy(f->args, sig, argc);
+  lua_pushvalue(L, 1);
+  f->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  HandleScope scope(ISOLATE);
+  Handle<Context> u = REF(Context, LV8_STATE->uctx);
+  u->Enter();
+  /* Not via FunctionTemplate, the context would cache it forever. */
+  Handle<Function> fn = Function::New(ISOLATE,
+      fn_stubs[argc > LV8_FN_ARITY ? LV8_FN_ARITY + 1 : argc][rtype],
+      External::New(ISOLATE, f));
+  f->fn.Reset(ISOLATE, fn);
+  f->fn.SetWeak(f, fn_weak_callback);
+  lv8_wrap_js2lua(L, fn);
+  u->Exit();
+  return 1;
+}
+
+/*
+ * lv8.scope(f, ...) runs f with a request scope. Lua values first seen
+ * by JS within it get their proxies from an arena rather than the heap.
+ * At scope exit all of them are unmapped and invalidated in bulk, JS
+ * left holding one throws on any use ("used after its lv8.scope()").
+ * JS retention is not detected: V8 cannot tell us whether a proxy was
+ * stored somewhere that outlives the scope. Any value JS is meant to
+ * keep (a callback registered with a library, a table it caches) must
+ * be passed through lv8.escape(v) by Lua, which moves the proxy to the
+ * heap. Scopes nest, escape always goes to the heap.
+ */
+
+/* New proxy in scope arena. */
+static lv8_object *scope_alloc(lua_State *L, lv8_scope *sc)
+{
+  lv8_arena *a = sc->arena;
+  if (!a || a->n == LV8_ARENA_CHUNK) {
+    lv8_state *state = LV8_STATE;
+    if ((a = state->spare)) {
+      state->spare = a->next;
+    } else {
+      a = new lv8_arena();
+      memset(a, 0, sizeof(*a));
+    }
+    a->n = 0;
+    a->next = sc->arena;
+    sc->arena = a;
+  }
+  return &a->objs[a->n++];
+}
+
+/* Push new scope. */
+static void scope_enter(lua_State *L)
+{
+  lv8_state *state = LV8_STATE;
+  lv8_scope *sc = new lv8_scope();
+  sc->prev = state->scope;
+  sc->arena = 0;
+  state->scope = sc;
+}
+
+/* Pop scope, invalidating proxies still alive. */
+static void scope_leave(lua_State *L)
+{
+  lv8_state *state = LV8_STATE;
+  lv8_scope *sc = state->scope;
+  if (!sc)
+    return;
+  state->scope = sc->prev;
+  gc_drain(L, -1); // Nothing may point to recycled chunks.
+  HandleScope scope(ISOLATE);
+  while (lv8_arena *a = sc->arena) {
+    for (int i = 0; i < a->n; i++) {
+      lv8_object *v = &a->objs[i];
+      if (v->object.IsEmpty())
+        continue; // Collected or escaped meanwhile.
+      OREF(v)->SetAlignedPointerInInternalField(0, 0);
+      persistent_lookup_js(L, v);
+      persistent_del(L, v);
+      v->object.Reset();
+      LV8_CENSUS(forget(v));
+    }
+    sc->arena = a->next;
+    a->next = state->spare; // Keep for the next request.
+    state->spare = a;
+  }
+  delete sc;
+}
+
+/* lv8.scope(f, ...) -> f(...) */
+static int lua_scope(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  scope_enter(L);
+  int status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+  scope_leave(L);
+  if (status != LUA_OK)
+    lua_error(L);
+  return lua_gettop(L);
+}
+
+/* lv8.escape(v) -> v, keep proxy of v past scope. */
+static int lua_escape(lua_State *L)
+{
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  lv8_object *v = persistent_lookup_lua(L, 1);
+  if (!v || !v->scoped || v->object.IsEmpty())
+    return 1;
+  HandleScope scope(ISOLATE);
+  lv8_object *h = new lv8_object();
+  memset(h, 0, sizeof(*h));
+  h->type = v->type;
+  Local<Object> o = OREF(v);
+  persistent_lookup_js(L, v);
+  persistent_del(L, v);
+  v->object.Reset();
+  o->SetAlignedPointerInInternalField(0, (void*)h);
+  h->object.Reset(ISOLATE, o);
+  persistent_add(L, 1, h);
+  h->object.SetWeak(LV8_STATE, js_weak_object);
+  LV8_CENSUS(move(v, h));
+  return 1;
+}
 
 /* Configure V8 flags. */
 static int lua_v8_flags(lua_State *L)
@@ -708,35 +1452,1892 @@ static int lua_v8_flags(lua_State *L)
   return 1; // Allow method chaining.
 }
 
-/* Attempt to force GC cycle (still unreliable). */
-static int lua_force_gc(lua_State *L)
+/* Lua changed t[key] (or anything in t) behind cached sandboxes. */
+static int lua_sb_touch(lua_State *L)
 {
-  while (!v8::V8::IdleNotification());
+  lv8_state *state = LV8_STATE;
+  if (!state->initialized)
+    return 0; // Nothing could have been cached yet.
+  if (lua_isnoneornil(L, 2)) {
+    state->sbepoch++;
+    return 0;
+  }
+  HandleScope scope(ISOLATE);
+  Handle<Context> u = REF(Context, state->uctx);
+  u->Enter();
+  sandbox_bump(L, convert_lua2js(L, 2)->ToString());
+  u->Exit();
   return 0;
 }
 
-/* ArrayBuffer allocator. */
-class ab_allocator : public ArrayBuffer::Allocator {
-  public:
-  virtual void* Allocate(size_t length) {
-    void *data = calloc(length, 1);
-    return data;
-  }
-  virtual void* AllocateUninitialized(size_t length) {
-    void *data = malloc(length);
-    return data;
-  }
-  virtual void Free(void* data, size_t length) {
-    free(data);
-  }
-};
+/* Check argument is JS context (not sandbox). */
+static lv8_context *check_context(lua_State *L, int idx)
+{
+  lv8_context *c = lv8_unwrap_lua(L, idx);
+  if (!c || c->type != LV8_OBJ_CTX)
+    luaL_argerror(L, idx, "JS context");
+  return c;
+}
 
-/* Initialize global state. */
-static void checkstate(lua_State *L)
+/* Own property names of context global, via the pristine
+ * Object.getOwnPropertyNames() saved by lv8_context_factory(). */
+static Handle<Array> ctx_names(Handle<Object> gl)
 {
-  lv8_state *state = LV8_STATE;
-  if (state->initialized) return;
-  V8::SetArrayBufferAllocator(new ab_allocator());
+  Handle<Value> gopn = gl->GetHiddenValue(LITERAL(LV8_GOPN));
+  if (gopn.IsEmpty() || !gopn->IsFunction())
+    return Handle<Array>();
+  Handle<Value> argv[] = { gl };
+  Handle<Value> names = gopn.As<Function>()->Call(gl, 1, argv);
+  if (names.IsEmpty() || !names->IsArray())
+    return Handle<Array>();
+  return names.As<Array>();
+}
+
+/*
+ * Record own properties (including non-enumerable) of context global.
+ * Only the bindings themselves are saved: objects they point to, and
+ * prototypes of builtins (Array.prototype.x = ...), keep any changes
+ * made after the checkpoint, rewind does not undo them.
+ * Layout of checkpoint array is:
+ * [unused, set of names, name1, value1, attr1, ...]
+ */
+static bool ctx_checkpoint(lv8_context *c)
+{
+  HandleScope scope(ISOLATE);
+  Handle<Object> gl = OREF(c);
+  TryCatch exc;
+  Handle<Array> names = ctx_names(gl);
+  if (names.IsEmpty())
+    return false;
+  uint32_t n = names->Length();
+  Handle<Array> cp = Array::New(ISOLATE, 2 + n * 3);
+  Handle<Object> set = Object::New(ISOLATE);
+  cp->Set(1, set);
+  for (uint32_t i = 0; i < n; i++) {
+    Handle<Value> k = names->Get(i);
+    set->ForceSet(k, True(ISOLATE));
+    cp->Set(2 + i * 3, k);
+    cp->Set(3 + i * 3, gl->Get(k));
+    cp->Set(4 + i * 3, Int32::New(ISOLATE, gl->GetPropertyAttributes(k)));
+  }
+  c->checkpoint.Reset(ISOLATE, cp);
+  return !exc.HasCaught();
+}
+
+/* Restore context global to last checkpoint, in a single pass. */
+static bool ctx_rewind(lv8_context *c)
+{
+  HandleScope scope(ISOLATE);
+  Handle<Object> gl = OREF(c);
+  Handle<Array> cp = REF(Array, c->checkpoint);
+  Handle<Object> set = cp->Get(1)->ToObject();
+  TryCatch exc;
+  Handle<Array> names = ctx_names(gl);
+  if (names.IsEmpty())
+    return false;
+  uint32_t n = names->Length();
+  for (uint32_t i = 0; i < n; i++) { // Drop additions.
+    Handle<Value> k = names->Get(i);
+    if (!set->HasOwnProperty(k->ToString()))
+      gl->ForceDelete(k);
+  }
+  n = (cp->Length() - 2) / 3;
+  for (uint32_t i = 0; i < n; i++) { // Restore replaced bindings.
+    Handle<Value> k = cp->Get(2 + i * 3);
+    Handle<Value> v = cp->Get(3 + i * 3);
+    if (gl->HasOwnProperty(k->ToString()) && gl->Get(k)->StrictEquals(v))
+      continue;
+    gl->ForceSet(k, v,
+        (PropertyAttribute)cp->Get(4 + i * 3)->Int32Value());
+  }
+  return !exc.HasCaught();
+}
+
+/* lv8.checkpoint(ctx) -> ctx */
+static int lua_ctx_checkpoint(lua_State *L)
+{
+  lv8_context *c = check_context(L, 1);
+  bool ok;
+  {
+    HandleScope scope(ISOLATE);
+    Handle<Context> ctx = CREF(c);
+    ctx->Enter();
+    ok = ctx_checkpoint(c);
+    ctx->Exit();
+  }
+  if (!ok)
+    luaL_error(L, "Cannot record context globals");
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* lv8.rewind(ctx) -> ctx */
+static int lua_ctx_rewind(lua_State *L)
+{
+  lv8_context *c = check_context(L, 1);
+  if (c->checkpoint.IsEmpty())
+    luaL_error(L, "Context has no checkpoint");
+  bool ok;
+  {
+    HandleScope scope(ISOLATE);
+    Handle<Context> ctx = CREF(c);
+    ctx->Enter();
+    ok = ctx_rewind(c);
+    ctx->Exit();
+  }
+  if (!ok)
+    luaL_error(L, "Cannot restore context globals");
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Attempt to force GC cycle (still unreliable). */
+static int lua_force_gc(lua_State *L)
+{
+  while (!v8::V8::IdleNotification());
+  gc_drain(L, -1);
+  return 0;
+}
+
+/* lv8.gc() */
+static int lua_gc_call(lua_State *L)
+{
+  lua_remove(L, 1); // Remove gc table.
+  return lua_force_gc(L);
+}
+
+/*
+ * Memory pressure. With LV8_CGROUP pointing at the cgroup v2 directory
+ * of the process (or a fake one with the same files, for testing),
+ * lv8.pressure() reads memory.current against memory.max, and the
+ * "some avg10" figure of memory.pressure (PSI) if present, and maps
+ * them to a level. Moderate runs a full Lua GC, a V8 idle round, drains
+ * dead proxies and drops spare arena chunks. Critical additionally
+ * runs V8 LowMemoryNotification (no MemoryPressureNotification here).
+ * At luaopen, a finite memory.max also caps the V8 old space.
+ */
+enum { LV8_PRESSURE_NONE, LV8_PRESSURE_MODERATE, LV8_PRESSURE_CRITICAL };
+
+/* Read first line of dir/name, NULL if missing. */
+static char *cgroup_read(const char *dir, const char *name, char *buf, int n)
+{
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char *r = fgets(buf, n, f);
+  fclose(f);
+  return r;
+}
+
+/* Numeric cgroup value, -1 if missing or "max". */
+static long long cgroup_value(const char *dir, const char *name)
+{
+  char buf[64];
+  if (!cgroup_read(dir, name, buf, sizeof(buf)) || !strncmp(buf, "max", 3))
+    return -1;
+  return strtoll(buf, 0, 10);
+}
+
+/* Pressure level from cgroup files at dir. */
+static int cgroup_level(const char *dir, long long *cur, long long *max)
+{
+  char buf[256];
+  double avg10 = 0;
+  int level = LV8_PRESSURE_NONE;
+  *cur = cgroup_value(dir, "memory.current");
+  *max = cgroup_value(dir, "memory.max");
+  if (*cur >= 0 && *max > 0) {
+    if (*cur * 100 >= *max * 95)
+      level = LV8_PRESSURE_CRITICAL;
+    else if (*cur * 100 >= *max * 80)
+      level = LV8_PRESSURE_MODERATE;
+  }
+  if (cgroup_read(dir, "memory.pressure", buf, sizeof(buf)) &&
+      sscanf(buf, "some avg10=%lf", &avg10) == 1) {
+    if (avg10 >= 40)
+      level = LV8_PRESSURE_CRITICAL;
+    else if (avg10 >= 10 && level < LV8_PRESSURE_MODERATE)
+      level = LV8_PRESSURE_MODERATE;
+  }
+  return level;
+}
+
+/* Cap V8 heap by cgroup limit, before V8 initializes. */
+static void cgroup_heap_flags()
+{
+  const char *dir = getenv(LV8_CGROUP_ENV);
+  long long max;
+  if (!dir || (max = cgroup_value(dir, "memory.max")) <= 0)
+    return;
+  char flags[64];
+  int n = snprintf(flags, sizeof(flags), "--max_old_space_size=%lld",
+      max / 100 * LV8_CGROUP_HEAP >> 20);
+  V8::SetFlagsFromString(flags, n);
+}
+
+/* lv8.pressure([dir [, level]]) -> level, current, max */
+static int lua_pressure(lua_State *L)
+{
+  const char *dir = luaL_optstring(L, 1, getenv(LV8_CGROUP_ENV));
+  long long cur = -1, max = -1;
+  int level;
+  if (!lua_isnoneornil(L, 2)) // Forced level.
+    level = luaL_checkinteger(L, 2);
+  else if (!dir)
+    return 0; // Not configured.
+  else
+    level = cgroup_level(dir, &cur, &max);
+  if (level >= LV8_PRESSURE_MODERATE) {
+    lv8_state *state = LV8_STATE;
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    if (state->initialized) {
+      V8::IdleNotification(100);
+      if (level >= LV8_PRESSURE_CRITICAL)
+        V8::LowMemoryNotification();
+    }
+    gc_drain(L, -1);
+    while (lv8_arena *a = state->spare) { // Shrink pool.
+      state->spare = a->next;
+      delete a;
+    }
+  }
+  lua_pushinteger(L, level);
+  lua_pushnumber(L, cur);
+  lua_pushnumber(L, max);
+  return 3;
+}
+
+/*
+ * lv8.configure{...} maps to ResourceConstraints of the isolate, and is
+ * only accepted before the first context is made. Sizes are validated
+ * and rounded to what V8 takes (semi space goes in whole MB), the
+ * effective values are reported by lv8.stats().
+ */
+static const struct {
+  const char *name;
+  int min, max;
+  size_t off;
+} lv8_limit_keys[] = {
+  { "max_old_space_mb", 16, 1 << 20, offsetof(lv8_limits, max_old_space_mb) },
+  { "semi_space_kb", 512, 1 << 20, offsetof(lv8_limits, semi_space_kb) },
+  { "max_executable_mb", 16, 1 << 16, offsetof(lv8_limits, max_executable_mb) },
+  { "code_range_mb", 1, 1 << 12, offsetof(lv8_limits, code_range_mb) },
+  { "stack_kb", 64, 1 << 20, offsetof(lv8_limits, stack_kb) },
+  { 0 }
+};
+
+/* Value at -1 of field 'name' of table argument 1, must be integer. */
+static lua_Integer field_int(lua_State *L, const char *name)
+{
+  int isnum;
+  lua_Integer v = lua_tointegerx(L, -1, &isnum);
+  if (!isnum)
+    luaL_argerror(L, 1, lua_pushfstring(L, "%s must be an integer", name));
+  return v;
+}
+
+/* lv8.configure{max_old_space_mb=, semi_space_kb=, ...} */
+static int lua_configure(lua_State *L)
+{
+  lv8_state *state = LV8_STATE;
+  lv8_limits lim = state->limits;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (state->initialized)
+    return luaL_error(L, "lv8.configure() must precede first use");
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    const char *k = lua_tostring(L, -2);
+    int i;
+    for (i = 0; k && lv8_limit_keys[i].name; i++)
+      if (!strcmp(k, lv8_limit_keys[i].name))
+        break;
+    if (!k || !lv8_limit_keys[i].name)
+      return luaL_error(L, "unknown constraint '%s'", k ? k : "?");
+    lua_Integer v = field_int(L, k);
+    if (v < lv8_limit_keys[i].min || v > lv8_limit_keys[i].max)
+      return luaL_error(L, "%s out of range [%d, %d]", k,
+          lv8_limit_keys[i].min, lv8_limit_keys[i].max);
+    *(int*)((char*)&lim + lv8_limit_keys[i].off) = v;
+    lua_pop(L, 1);
+  }
+  lim.semi_space_kb = (lim.semi_space_kb + 1023) & ~1023;
+
+  ResourceConstraints rc;
+  if (lim.max_old_space_mb)
+    rc.set_max_old_space_size(lim.max_old_space_mb);
+  if (lim.semi_space_kb)
+    rc.set_max_semi_space_size(lim.semi_space_kb >> 10);
+  if (lim.max_executable_mb)
+    rc.set_max_executable_size(lim.max_executable_mb);
+  if (lim.code_range_mb)
+    rc.set_code_range_size(lim.code_range_mb);
+  if (lim.stack_kb) { // Relative to this thread, grows down.
+    char here;
+    rc.set_stack_limit((uint32_t*)(&here - ((size_t)lim.stack_kb << 10)));
+  }
+  if (!SetResourceConstraints(ISOLATE, &rc))
+    return luaL_error(L, "V8 rejected resource constraints");
+  state->limits = lim;
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* lv8.stats() -> table */
+static int lua_stats(lua_State *L)
+{
+  lv8_state *state = LV8_STATE;
+  lua_createtable(L, 0, 12);
+  for (int i = 0; lv8_limit_keys[i].name; i++) {
+    lua_pushinteger(L,
+        *(int*)((char*)&state->limits + lv8_limit_keys[i].off));
+    lua_setfield(L, -2, lv8_limit_keys[i].name);
+  }
+  if (!state->initialized)
+    return 1; // Heap not set up yet.
+  HeapStatistics hs;
+  ISOLATE->GetHeapStatistics(&hs);
+#define STAT(f) lua_pushnumber(L, hs.f()); lua_setfield(L, -2, #f);
+  STAT(total_heap_size)
+  STAT(total_heap_size_executable)
+  STAT(total_physical_size)
+  STAT(used_heap_size)
+  STAT(heap_size_limit)
+#undef STAT
+  return 1;
+}
+
+/* lv8.gc.step([ms]) -> done; foreground tasks, idle work, V8 idle GC. */
+static int lua_gc_step(lua_State *L)
+{
+  double budget = luaL_optnumber(L, 1, 10) / 1000;
+#if !NON_POSIX
+  budget = lv8_platform_step(budget);
+#endif
+  bool done = true;
+  if (LV8_STATE->initialized)
+    done = V8::IdleNotification((int)(budget * 1000));
+  gc_drain(L, LV8_GC_BATCH);
+  lua_pushboolean(L, done);
+  return 1;
+}
+
+#if !NON_POSIX
+/*
+ * lv8.platform{threads=n, cpus={...}}, lv8.platform() -> counters
+ * Opt-in, V8 keeps its own platform otherwise. Once installed, queued
+ * foreground work only runs from lv8.gc.step(), so the host must call
+ * it regularly (eg. from its event loop).
+ */
+static int lua_platform(lua_State *L)
+{
+  static const char *const names[LV8_TASK_MAX] = {
+    "background", "long", "foreground", "delayed", "idle"
+  };
+  if (lua_istable(L, 1)) {
+    int cpus[LV8_PLATFORM_MAXCPUS];
+    int ncpus = 0;
+    if (LV8_STATE->initialized)
+      return luaL_error(L, "lv8.platform() must precede first use");
+    lua_getfield(L, 1, "threads");
+    int threads = -1; // Default.
+    if (!lua_isnil(L, -1)) {
+      threads = field_int(L, "threads");
+      luaL_argcheck(L, threads >= 1, 1, "threads must be positive");
+    }
+    lua_getfield(L, 1, "cpus");
+    luaL_argcheck(L, lua_isnil(L, -1) || lua_istable(L, -1), 1,
+        "cpus must be a table");
+    if (lua_istable(L, -1)) {
+      ncpus = lua_rawlen(L, -1);
+      luaL_argcheck(L, ncpus <= LV8_PLATFORM_MAXCPUS, 1, "too many cpus");
+      for (int i = 0; i < ncpus; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        cpus[i] = field_int(L, "each of cpus");
+        luaL_argcheck(L, cpus[i] >= 0, 1, "negative cpu");
+        lua_pop(L, 1);
+      }
+    }
+    if (lv8_platform_setup(threads, cpus, ncpus))
+      return luaL_error(L, "platform already installed");
+    lua_settop(L, 1);
+    return 1;
+  }
+  lv8_platform_stats st;
+  lv8_platform_counters(&st);
+  lua_createtable(L, 0, 1 + 2 * LV8_TASK_MAX);
+  lua_pushinteger(L, st.threads);
+  lua_setfield(L, -2, "threads");
+  for (int i = 0; i < LV8_TASK_MAX; i++) {
+    lua_pushfstring(L, "posted_%s", names[i]);
+    lua_pushnumber(L, st.posted[i]);
+    lua_rawset(L, -3);
+    lua_pushfstring(L, "ran_%s", names[i]);
+    lua_pushnumber(L, st.ran[i]);
+    lua_rawset(L, -3);
+  }
+  return 1;
+}
+#endif
+
+#if !NON_POSIX
+/* lv8.perfmap([true | "jitdump" | false]) */
+static int lua_perfmap(lua_State *L)
+{
+  if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+    lv8_perfmap_stop();
+    return 0;
+  }
+  const char *mode = lua_tostring(L, 1);
+  if (lv8_perfmap_start(mode && !strcmp(mode, "jitdump")))
+    return luaL_error(L, "cannot write perf map");
+  return 0;
+}
+#endif
+
+#if !NON_POSIX
+/* lv8.profile([{interval=us, count=n}]) starts, lv8.profile(false) -> folded */
+static int lua_profile(lua_State *L)
+{
+  if (lua_isboolean(L, 1) && !lua_toboolean(L, 1)) {
+    lv8_prof_stop(L);
+    return 1;
+  }
+  int interval = 0, count = 0;
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "interval");
+    interval = lua_isnil(L, -1) ? 0 : field_int(L, "interval");
+    lua_getfield(L, 1, "count");
+    count = lua_isnil(L, -1) ? 0 : field_int(L, "count");
+  }
+  checkstate(L);
+  if (lv8_prof_start(L, interval, count))
+    return luaL_error(L, "profiler already running");
+  return 0;
+}
+#endif
+
+#if !NON_POSIX
+/*
+ * lv8.census(true|false) turns allocation site tracking of proxies on or
+ * off, lv8.census() -> {{site=, type=, count=, oldest=, mean=}, ...} with
+ * live proxies made while on, by site and type, ages in seconds.
+ */
+static int lua_census(lua_State *L)
+{
+  if (lua_isboolean(L, 1)) {
+    lv8_census_enable(lua_toboolean(L, 1));
+    return 0;
+  }
+  lv8_census_push(L);
+  return 1;
+}
+#endif
+
+#if !NON_POSIX
+/* lv8.trace.now() -> ms */
+static int lua_trace_now(lua_State *L)
+{
+  lua_pushnumber(L, lv8_trace_now() / 1e6);
+  return 1;
+}
+
+/* lv8.trace.mark(name) */
+static int lua_trace_mark(lua_State *L)
+{
+  size_t n;
+  const char *s = luaL_checklstring(L, 1, &n);
+  lv8_trace_mark(s, n);
+  return 0;
+}
+
+/* lv8.trace.measure(name, start [, end]) */
+static int lua_trace_measure(lua_State *L)
+{
+  size_t n;
+  const char *s = luaL_checklstring(L, 1, &n);
+  lv8_trace_measure(s, n, lv8_ms2ns(luaL_checknumber(L, 2)),
+      lua_isnoneornil(L, 3) ? LV8_TRACE_NOW :
+      lv8_ms2ns(luaL_checknumber(L, 3)));
+  return 0;
+}
+
+/* lv8.trace.drain([json = true]) -> string */
+static int lua_trace_drain(lua_State *L)
+{
+  lv8_trace_drain(L, lua_isnone(L, 1) || lua_toboolean(L, 1));
+  return 1;
+}
+#endif
+
+/* lv8.gc.drain([max]) -> released */
+static int lua_gc_drain(lua_State *L)
+{
+  lua_pushinteger(L, gc_drain(L, luaL_optinteger(L, 1, -1)));
+  return 1;
+}
+
+/*
+ * lv8.json, V8's JSON parser with a native encoder. Decoding parses
+ * in the utility context and converts the result to Lua tables in one
+ * pass, without proxies; JSON null becomes lv8.json.null. Encoding is
+ * plain C++ over Lua tables with JSON.stringify() escaping and number
+ * formatting; bytes which are not valid UTF-8 become U+FFFD, as they
+ * do when V8 reads UTF-8. A table is
+ * an array if its keys are exactly 1..#t, otherwise an object with
+ * string (or number) keys; functions are skipped in objects and null
+ * in arrays, like in JS. Given a sink, the encoder hands it output in
+ * pieces of about LV8_JSON_CHUNK bytes instead of building one string.
+ */
+
+/* Is buffer 7bit clean? */
+static bool json_ascii(const char *p, size_t n)
+{
+  unsigned char acc = 0;
+  while (n--)
+    acc |= *p++;
+  return !(acc & 0x80);
+}
+
+/* Convert parsed value to Lua, false if out of Lua stack. */
+static bool json_js2lua(lua_State *L, Handle<Value> v)
+{
+  if (!lua_checkstack(L, 3))
+    return false;
+  if (v->IsString()) {
+    push_string(L, v);
+  } else if (v->IsNumber()) {
+    lua_pushnumber(L, v->NumberValue());
+  } else if (v->IsBoolean()) {
+    lua_pushboolean(L, v->BooleanValue());
+  } else if (v->IsNull()) {
+    lua_pushlightuserdata(L, 0); // lv8.json.null
+  } else if (v->IsArray()) {
+    Handle<Array> a = v.As<Array>();
+    uint32_t n = a->Length();
+    lua_createtable(L, n, 0);
+    for (uint32_t i = 0; i < n; i++) {
+      HandleScope scope(ISOLATE);
+      if (!json_js2lua(L, a->Get(i)))
+        return false;
+      lua_rawseti(L, -2, i + 1);
+    }
+  } else {
+    Handle<Object> o = v.As<Object>();
+    Handle<Array> keys = o->GetOwnPropertyNames();
+    uint32_t n = keys->Length();
+    lua_createtable(L, 0, n);
+    for (uint32_t i = 0; i < n; i++) {
+      HandleScope scope(ISOLATE);
+      Handle<Value> k = keys->Get(i);
+      push_string(L, k); // Index keys stay strings.
+      if (!json_js2lua(L, o->Get(k)))
+        return false;
+      lua_rawset(L, -3);
+    }
+  }
+  return true;
+}
+
+/* lv8.json.decode(s) -> value */
+static int lua_json_decode(lua_State *L)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  lua_settop(L, 1);
+  checkstate(L);
+  bool failed = false;
+  {
+    HandleScope scope(ISOLATE);
+    lv8_state *state = LV8_STATE;
+    Handle<Context> u = REF(Context, state->uctx);
+    u->Enter();
+    Local<String> src;
+    if (len >= LV8_JSON_EXTERNAL && json_ascii(s, len)) {
+      lua_pushvalue(L, 1);
+      src = String::NewExternal(ISOLATE, new lv8_extstr(state, s, len,
+            luaL_ref(L, LUA_REGISTRYINDEX)));
+    } else {
+      src = UTF8(s, String::kNormalString, len);
+    }
+    TryCatch exc;
+    Handle<Value> v = JSON::Parse(src);
+    if (exc.HasCaught()) {
+      String::Utf8Value msg(exc.Exception());
+      lua_pushstring(L, *msg ? *msg : "invalid JSON");
+      failed = true;
+    } else if (!json_js2lua(L, v)) {
+      lua_settop(L, 1);
+      lua_pushliteral(L, "nested too deep");
+      failed = true;
+    }
+    u->Exit();
+  }
+  if (failed)
+    return luaL_error(L, "json: %s", lua_tostring(L, -1));
+  return 1;
+}
+
+/* Encoder output. */
+struct json_out {
+  lua_State *L;
+  char *p;
+  size_t n, cap;
+  size_t total; // Bytes handed to sink.
+  int sink; // Stack index of sink, 0 if none.
+  const char *err; // Failed, or sink raised (error on stack) if "".
+};
+
+static bool json_put(json_out *o, const char *s, size_t n)
+{
+  if (o->n + n > o->cap) {
+    size_t cap = o->cap ? o->cap : 256;
+    while (cap < o->n + n)
+      cap *= 2;
+    char *p = (char*)realloc(o->p, cap);
+    if (!p) {
+      o->err = "out of memory";
+      return false;
+    }
+    o->p = p;
+    o->cap = cap;
+  }
+  memcpy(o->p + o->n, s, n);
+  o->n += n;
+  return true;
+}
+#define JSON_PUT(o, lit) json_put(o, lit, sizeof(lit) - 1)
+
+/* Hand output to sink once there is enough of it (or force). */
+static bool json_flush(json_out *o, bool force)
+{
+  lua_State *L = o->L;
+  if (!o->sink || !o->n || (!force && o->n < LV8_JSON_CHUNK))
+    return true;
+  lua_pushvalue(L, o->sink);
+  lua_pushlstring(L, o->p, o->n);
+  if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+    o->err = "";
+    return false;
+  }
+  o->total += o->n;
+  o->n = 0;
+  return true;
+}
+
+/* Length of valid UTF-8 sequence at p (lead byte >= 0x80), 0 if none. */
+static size_t json_utf8(const unsigned char *p, size_t n)
+{
+  unsigned char c = p[0], lo = 0x80, hi = 0xbf;
+  size_t len;
+  if (c >= 0xc2 && c <= 0xdf)
+    len = 2;
+  else if (c >= 0xe0 && c <= 0xef)
+    len = 3;
+  else if (c >= 0xf0 && c <= 0xf4)
+    len = 4;
+  else
+    return 0;
+  if (c == 0xe0) lo = 0xa0; // Overlong.
+  if (c == 0xed) hi = 0x9f; // Surrogates.
+  if (c == 0xf0) lo = 0x90; // Overlong.
+  if (c == 0xf4) hi = 0x8f; // Past U+10FFFF.
+  if (n < len || p[1] < lo || p[1] > hi)
+    return 0;
+  for (size_t i = 2; i < len; i++)
+    if (p[i] < 0x80 || p[i] > 0xbf)
+      return 0;
+  return len;
+}
+
+/* Quoted string, escaped as by JSON.stringify(). */
+static bool json_string(json_out *o, const char *s, size_t n)
+{
+  static const char hex[] = "0123456789abcdef";
+  if (!JSON_PUT(o, "\""))
+    return false;
+  size_t run = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    if (c >= 0x80) {
+      size_t len = json_utf8((const unsigned char*)s + i, n - i);
+      if (len) {
+        i += len - 1;
+        continue;
+      }
+      if (!json_put(o, s + run, i - run) || !JSON_PUT(o, "\\ufffd"))
+        return false;
+      run = i + 1;
+      continue;
+    }
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    if (!json_put(o, s + run, i - run))
+      return false;
+    run = i + 1;
+    char esc[6] = { '\\', 0 };
+    int len = 2;
+    switch (c) {
+      case '"': esc[1] = '"'; break;
+      case '\\': esc[1] = '\\'; break;
+      case '\b': esc[1] = 'b'; break;
+      case '\f': esc[1] = 'f'; break;
+      case '\n': esc[1] = 'n'; break;
+      case '\r': esc[1] = 'r'; break;
+      case '\t': esc[1] = 't'; break;
+      default:
+        memcpy(esc + 1, "u00", 3);
+        esc[4] = hex[c >> 4];
+        esc[5] = hex[c & 15];
+        len = 6;
+    }
+    if (!json_put(o, esc, len))
+      return false;
+  }
+  return json_put(o, s + run, n - run) && JSON_PUT(o, "\"");
+}
+
+/*
+ * Number as by JS Number::toString(): shortest digits which read back
+ * the same, plain notation for decimal exponents -6 < n <= 21 and
+ * exponential otherwise (1e21, 1.5e-7). size must be 32 or more.
+ */
+static int json_numstr(char *buf, size_t size, double d)
+{
+  char e[32], digits[20];
+  if (!isfinite(d))
+    return snprintf(buf, size, "null");
+  if (d == 0)
+    return snprintf(buf, size, "0"); // No "-0" either.
+  for (int prec = 0; prec < 17; prec++) { // "d.ddde+x", shortest first.
+    snprintf(e, sizeof(e), "%.*e", prec, fabs(d));
+    if (strtod(e, 0) == fabs(d))
+      break;
+  }
+  int k = 0; // Digits d1..dk, value is 0.d1..dk * 10^n.
+  const char *p = e;
+  for (; *p != 'e'; p++)
+    if (*p != '.')
+      digits[k++] = *p;
+  int n = atoi(p + 1) + 1;
+  while (k > 1 && digits[k - 1] == '0')
+    k--;
+  char *o = buf;
+  if (d < 0)
+    *o++ = '-';
+  if (k <= n && n <= 21) { // 1e20 -> "100000000000000000000"
+    memcpy(o, digits, k);
+    memset(o + k, '0', n - k);
+    o += n;
+  } else if (0 < n && n <= 21) { // 1.5
+    memcpy(o, digits, n);
+    o[n] = '.';
+    memcpy(o + n + 1, digits + n, k - n);
+    o += k + 1;
+  } else if (-6 < n && n <= 0) { // 0.000001
+    memcpy(o, "0.", 2);
+    memset(o + 2, '0', -n);
+    memcpy(o + 2 - n, digits, k);
+    o += 2 - n + k;
+  } else { // 1e21, 1.5e-7
+    *o++ = digits[0];
+    if (k > 1) {
+      *o++ = '.';
+      memcpy(o, digits + 1, k - 1);
+      o += k - 1;
+    }
+    o += snprintf(o, size - (o - buf), "e%c%d", n > 0 ? '+' : '-',
+        abs(n - 1));
+  }
+  *o = 0;
+  return o - buf;
+}
+
+/* Skipped in objects, null in arrays. */
+static bool json_skip(lua_State *L, int idx)
+{
+  int t = lua_type(L, idx);
+  return t == LUA_TFUNCTION || t == LUA_TTHREAD || t == LUA_TNONE;
+}
+
+static bool json_value(json_out *o, int idx, int depth);
+
+/* Table at idx as array or object. */
+static bool json_table(json_out *o, int idx, int depth)
+{
+  lua_State *L = o->L;
+  if (depth > LV8_JSON_DEPTH) {
+    o->err = "nested too deep (cycle?)";
+    return false;
+  }
+  if (!lua_checkstack(L, 4)) {
+    o->err = "out of stack";
+    return false;
+  }
+  size_t n = lua_rawlen(L, idx), count = 0;
+  bool array = n > 0;
+  if (array) { // Keys exactly 1..n?
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      lua_pop(L, 1);
+      lua_Number k = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : 0;
+      if (k < 1 || k > n || k != floor(k)) {
+        lua_pop(L, 1);
+        array = false;
+        break;
+      }
+      count++;
+    }
+    array = array && count == n;
+  }
+  if (array) {
+    if (!JSON_PUT(o, "["))
+      return false;
+    for (size_t i = 1; i <= n; i++) {
+      if (i > 1 && !JSON_PUT(o, ","))
+        return false;
+      lua_rawgeti(L, idx, i);
+      if (json_skip(L, -1) ? !JSON_PUT(o, "null") :
+          !json_value(o, lua_gettop(L), depth + 1))
+        return false;
+      lua_pop(L, 1);
+      if (!json_flush(o, false))
+        return false;
+    }
+    return JSON_PUT(o, "]");
+  }
+  bool first = true;
+  if (!JSON_PUT(o, "{"))
+    return false;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (json_skip(L, -1)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    if (!first && !JSON_PUT(o, ","))
+      return false;
+    first = false;
+    if (lua_type(L, -2) == LUA_TNUMBER) {
+      char buf[32];
+      int len = json_numstr(buf, sizeof(buf), lua_tonumber(L, -2));
+      if (!json_string(o, buf, len))
+        return false;
+    } else if (lua_type(L, -2) == LUA_TSTRING) {
+      size_t len;
+      const char *s = lua_tolstring(L, -2, &len);
+      if (!json_string(o, s, len))
+        return false;
+    } else {
+      o->err = "object key must be string or number";
+      return false;
+    }
+    if (!JSON_PUT(o, ":") || !json_value(o, lua_gettop(L), depth + 1))
+      return false;
+    lua_pop(L, 1);
+    if (!json_flush(o, false))
+      return false;
+  }
+  return JSON_PUT(o, "}");
+}
+
+static bool json_value(json_out *o, int idx, int depth)
+{
+  lua_State *L = o->L;
+  char buf[32];
+  size_t len;
+  const char *s;
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      return JSON_PUT(o, "null");
+    case LUA_TBOOLEAN:
+      return lua_toboolean(L, idx) ? JSON_PUT(o, "true") :
+        JSON_PUT(o, "false");
+    case LUA_TNUMBER:
+      len = json_numstr(buf, sizeof(buf), lua_tonumber(L, idx));
+      return json_put(o, buf, len);
+    case LUA_TSTRING:
+      s = lua_tolstring(L, idx, &len);
+      return json_string(o, s, len);
+    case LUA_TTABLE:
+      return json_table(o, idx, depth);
+    case LUA_TLIGHTUSERDATA:
+      if (!lua_touserdata(L, idx))
+        return JSON_PUT(o, "null"); // lv8.json.null
+      break;
+    case LUA_TUSERDATA:
+      if (lua_getmetatable(L, idx)) {
+        bool lazy = lua_rawequal(L, -1, UV_STRMT);
+        lua_pop(L, 1);
+        if (lazy) {
+          HandleScope scope(ISOLATE);
+          String::Utf8Value str(Local<String>::New(ISOLATE,
+                ((lv8_jsstring*)lua_touserdata(L, idx))->str));
+          return json_string(o, *str, str.length());
+        }
+      }
+      break;
+  }
+  o->err = lua_pushfstring(L, "cannot encode %s", luaL_typename(L, idx));
+  return false;
+}
+
+/* lv8.json.encode(v [, sink]) -> string, or bytes passed to sink(piece) */
+static int lua_json_encode(lua_State *L)
+{
+  luaL_checkany(L, 1);
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
+  json_out o;
+  memset(&o, 0, sizeof(o));
+  o.L = L;
+  o.sink = lua_isnil(L, 2) ? 0 : 2;
+  if (!json_value(&o, 1, 0) || !json_flush(&o, true)) {
+    free(o.p);
+    if (!*o.err)
+      return lua_error(L); // Raised by sink.
+    return luaL_error(L, "json: %s", o.err);
+  }
+  if (o.sink)
+    lua_pushnumber(L, o.total);
+  else
+    lua_pushlstring(L, o.p, o.n);
+  free(o.p);
+  return 1;
+}
+
+/*
+ * lv8.regex(pattern [, flags]) compiles pattern with Irregexp, handles
+ * are cached by pattern and flags. Lua strings are bytes, so pattern
+ * and subjects are seen by V8 as Latin-1: one char per byte, indices
+ * are byte offsets and UTF-8 is matched bytewise, as with Lua patterns.
+ * Except with 'i': V8 case folds Latin-1, so bytes 0xC0-0xFE match their
+ * other case too (0xC3 0xA9 "é" also matches 0xC3 0x89 "É", but equally
+ * any unrelated UTF-8 pair differing by 0x20 in such a byte); keep 'i'
+ * to ASCII data. Errors raised while matching (eg. stack overflow on a
+ * pathological pattern) are raised as Lua errors, never as no match.
+ * Long subjects are external strings over the Lua string itself.
+ * Matches are reported as 1-based start, end integers; captures are
+ * only copied to Lua strings when asked for.
+ */
+#define LV8_REGEX_EXTERNAL 4096 // Subjects this long are read in place.
+static char lv8_regex_key; // Registry key of the handle cache.
+
+/* gmatch state table, ORDER lua_regex_gmatch. */
+enum { GM_RE = 1, GM_SUBJECT, GM_STR, GM_POS, GM_SUBS };
+
+/* Regex handle at idx, or error. */
+static lv8_regex *regex_check(lua_State *L, int idx)
+{
+  lv8_regex *r = (lv8_regex*)lua_touserdata(L, idx);
+  if (!r || !lua_getmetatable(L, idx) || !lua_rawequal(L, -1, UV_REMT))
+    luaL_argerror(L, idx, "lv8.regex expected");
+  lua_pop(L, 1);
+  return r;
+}
+
+/* Lua string at idx as Latin-1 JS string, in place if long. */
+static Local<String> latin1_string(lua_State *L, int idx)
+{
+  size_t len;
+  const char *s = lua_tolstring(L, idx, &len);
+  if (len >= LV8_REGEX_EXTERNAL) {
+    lua_pushvalue(L, idx);
+    return String::NewExternal(ISOLATE, new lv8_extstr(LV8_STATE, s, len,
+          luaL_ref(L, LUA_REGISTRYINDEX)));
+  }
+  return String::NewFromOneByte(ISOLATE, (const uint8_t*)s,
+      String::kNormalString, len);
+}
+
+/* Push Latin-1 JS string as Lua bytes. */
+static void push_latin1(lua_State *L, Handle<Value> v)
+{
+  luaL_Buffer b;
+  Handle<String> s = v->ToString();
+  int n = s->Length();
+  char *p = luaL_buffinitsize(L, &b, n);
+  s->WriteOneByte((uint8_t*)p, 0, n, String::NO_NULL_TERMINATION);
+  luaL_pushresultsize(&b, n);
+}
+
+/* Match r against subject from pos, null or match array. */
+static Handle<Value> regex_run(lv8_regex *r, Handle<String> subject,
+    int pos)
+{
+  Handle<RegExp> re = REF(RegExp, r->re);
+  Handle<Value> argv[1] = { subject };
+  re->Set(LITERAL("lastIndex"), Integer::New(ISOLATE, pos));
+  return REF(Function, r->exec)->Call(re, 1, argv);
+}
+
+/* Message of exception caught while matching, into buf. */
+static const char *regex_error(TryCatch &exc, char *buf, size_t n)
+{
+  String::Utf8Value msg(exc.Exception());
+  snprintf(buf, n, "%s", *msg ? *msg : "match failed");
+  return buf;
+}
+
+/* Push captures of match m (whole match if none), returns count. */
+static int regex_captures(lua_State *L, Handle<Array> m)
+{
+  int n = m->Length();
+  if (!lua_checkstack(L, n + 1))
+    return 0;
+  for (int i = n > 1; i < n; i++) {
+    Handle<Value> c = m->Get(i);
+    if (c->IsUndefined())
+      lua_pushboolean(L, 0); // Group did not participate.
+    else
+      push_latin1(L, c);
+  }
+  return n > 1 ? n - 1 : 1;
+}
+
+/* lv8.regex(pattern [, flags]) -> handle */
+static int lua_regex(lua_State *L)
+{
+  size_t len;
+  const char *pat = luaL_checklstring(L, 1, &len);
+  const char *fl = luaL_optstring(L, 2, "");
+  int flags = RegExp::kGlobal; // For lastIndex, 'g' is implied.
+  for (const char *f = fl; *f; f++) {
+    if (*f == 'i')
+      flags |= RegExp::kIgnoreCase;
+    else if (*f == 'm')
+      flags |= RegExp::kMultiline;
+    else if (*f != 'g')
+      return luaL_argerror(L, 2, "flags are 'i', 'm' and 'g'");
+  }
+  lua_settop(L, 2);
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &lv8_regex_key);
+  if (lua_isnil(L, -1)) { // Weak valued, "flags/pattern" -> handle.
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &lv8_regex_key);
+  }
+  lua_pushinteger(L, flags);
+  lua_pushliteral(L, "/");
+  lua_pushvalue(L, 1);
+  lua_concat(L, 3);
+  lua_pushvalue(L, -1);
+  lua_rawget(L, 3);
+  if (!lua_isnil(L, -1))
+    return 1;
+  lua_pop(L, 1);
+
+  checkstate(L);
+  lv8_regex *r = (lv8_regex*)lua_newuserdata(L, sizeof(*r));
+  memset(r, 0, sizeof(*r));
+  lua_pushvalue(L, UV_REMT);
+  lua_setmetatable(L, -2);
+  bool failed = false;
+  {
+    HandleScope scope(ISOLATE);
+    Handle<Context> u = REF(Context, LV8_STATE->uctx);
+    u->Enter();
+    TryCatch exc;
+    Handle<RegExp> re = RegExp::New(String::NewFromOneByte(ISOLATE,
+          (const uint8_t*)pat, String::kNormalString, len),
+        (RegExp::Flags)flags);
+    if (exc.HasCaught()) {
+      String::Utf8Value msg(exc.Exception());
+      lua_pushstring(L, *msg ? *msg : "invalid regex");
+      failed = true;
+    } else {
+      r->re.Reset(ISOLATE, re);
+      r->exec.Reset(ISOLATE, re->Get(LITERAL("exec")).As<Function>());
+    }
+    u->Exit();
+  }
+  if (failed)
+    return luaL_error(L, "regex: %s", lua_tostring(L, -1));
+  lua_pushvalue(L, 4); // Key.
+  lua_pushvalue(L, -2);
+  lua_rawset(L, 3);
+  return 1;
+}
+
+/* re:exec(s [, init [, subs]]) -> start, end [, captures...] | nil */
+static int lua_regex_exec(lua_State *L)
+{
+  lv8_regex *r = regex_check(L, 1);
+  size_t len;
+  luaL_checklstring(L, 2, &len);
+  lua_Integer init = luaL_optinteger(L, 3, 1);
+  bool subs = lua_toboolean(L, 4);
+  if (init < 0)
+    init += len + 1;
+  if (init < 1)
+    init = 1;
+  if ((size_t)init > len + 1) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_settop(L, 2);
+  int n = 1;
+  char emsg[256];
+  const char *err = 0;
+  {
+    HandleScope scope(ISOLATE);
+    Handle<Context> u = REF(Context, LV8_STATE->uctx);
+    u->Enter();
+    TryCatch exc;
+    Handle<Value> m = regex_run(r, latin1_string(L, 2), init - 1);
+    if (m.IsEmpty()) {
+      err = regex_error(exc, emsg, sizeof(emsg));
+    } else if (m->IsNull()) {
+      lua_pushnil(L);
+    } else {
+      Handle<Array> a = m.As<Array>();
+      int start = a->Get(LITERAL("index"))->Int32Value();
+      lua_pushinteger(L, start + 1);
+      lua_pushinteger(L, start + a->Get(0).As<String>()->Length());
+      n = 2 + (subs ? regex_captures(L, a) : 0);
+    }
+    u->Exit();
+  }
+  if (err)
+    return luaL_error(L, "regex: %s", err);
+  return n;
+}
+
+/* gmatch iterator, state table at 1. */
+static int regex_gmatch_aux(lua_State *L)
+{
+  lua_rawgeti(L, 1, GM_POS);
+  int pos = lua_tointeger(L, -1);
+  if (pos < 0)
+    return 0; // Done.
+  lua_rawgeti(L, 1, GM_RE);
+  lua_rawgeti(L, 1, GM_SUBJECT);
+  lua_rawgeti(L, 1, GM_SUBS);
+  lv8_regex *r = (lv8_regex*)lua_touserdata(L, 3);
+  lv8_jsstring *subject = (lv8_jsstring*)lua_touserdata(L, 4);
+  bool subs = lua_toboolean(L, 5);
+  lua_settop(L, 1);
+  int n = 0;
+  char emsg[256];
+  const char *err = 0;
+  {
+    HandleScope scope(ISOLATE);
+    Handle<Context> u = REF(Context, LV8_STATE->uctx);
+    u->Enter();
+    TryCatch exc;
+    Handle<String> s = REF(String, subject->str);
+    Handle<Value> m = regex_run(r, s, pos);
+    if (m.IsEmpty()) {
+      err = regex_error(exc, emsg, sizeof(emsg));
+    } else if (m->IsNull()) {
+      pos = -1;
+    } else {
+      Handle<Array> a = m.As<Array>();
+      int start = a->Get(LITERAL("index"))->Int32Value();
+      int mlen = a->Get(0).As<String>()->Length();
+      lua_pushinteger(L, start + 1);
+      lua_pushinteger(L, start + mlen);
+      n = 2 + (subs ? regex_captures(L, a) : 0);
+      pos = mlen ? start + mlen : start + 1; // Step over empty match.
+      if (pos > s->Length())
+        pos = -1;
+    }
+    u->Exit();
+  }
+  if (err)
+    return luaL_error(L, "regex: %s", err);
+  lua_pushinteger(L, pos);
+  lua_rawseti(L, 1, GM_POS);
+  return n;
+}
+
+/* re:gmatch(s [, subs]) -> aux, state, nil; yields start, end [, caps] */
+static int lua_regex_gmatch(lua_State *L)
+{
+  regex_check(L, 1);
+  luaL_checkstring(L, 2);
+  lua_settop(L, 3);
+  pushcclosure_uv(L, regex_gmatch_aux);
+  lua_createtable(L, GM_SUBS, 0); // State.
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, GM_RE);
+  lv8_jsstring *s = (lv8_jsstring*)lua_newuserdata(L, sizeof(*s));
+  memset(s, 0, sizeof(*s));
+  lua_pushvalue(L, UV_STRMT); // Releases the subject.
+  lua_setmetatable(L, -2);
+  {
+    HandleScope scope(ISOLATE);
+    s->str.Reset(ISOLATE, latin1_string(L, 2)); // Made once, not per match.
+  }
+  lua_rawseti(L, -2, GM_SUBJECT);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, GM_STR);
+  lua_pushinteger(L, 0);
+  lua_rawseti(L, -2, GM_POS);
+  lua_pushboolean(L, lua_toboolean(L, 3));
+  lua_rawseti(L, -2, GM_SUBS);
+  lua_pushnil(L);
+  return 3;
+}
+
+/* Append replacement of match m (at start, mlen bytes of s) to b. */
+static const char *regex_repl(lua_State *L, luaL_Buffer *b, Handle<Array> m,
+    const char *s, int start, int mlen)
+{
+  size_t rlen;
+  const char *r;
+  switch (lua_type(L, 3)) {
+    case LUA_TFUNCTION: {
+      lua_pushvalue(L, 3);
+      int n = regex_captures(L, m);
+      if (!n)
+        return "out of stack";
+      if (lua_pcall(L, n, 1, 0) != LUA_OK)
+        return ""; // Error on stack.
+      break;
+    }
+    case LUA_TTABLE:
+      if (m->Length() > 1)
+        push_latin1(L, m->Get(1));
+      else
+        lua_pushlstring(L, s + start, mlen);
+      lua_rawget(L, 3);
+      break;
+    default: // String, Lua style %0-%9.
+      r = lua_tolstring(L, 3, &rlen);
+      for (size_t i = 0; i < rlen; i++) {
+        if (r[i] != '%') {
+          luaL_addchar(b, r[i]);
+        } else if (++i < rlen && r[i] == '%') {
+          luaL_addchar(b, '%');
+        } else if (i < rlen && r[i] >= '0' && r[i] <= '9') {
+          int k = r[i] - '0';
+          if (k == 0 || (k == 1 && m->Length() == 1)) {
+            luaL_addlstring(b, s + start, mlen);
+          } else if (k < (int)m->Length()) {
+            Handle<Value> c = m->Get(k);
+            if (!c->IsUndefined()) {
+              push_latin1(L, c);
+              luaL_addvalue(b);
+            }
+          } else {
+            return "invalid capture index in replacement string";
+          }
+        } else {
+          return "invalid use of '%' in replacement string";
+        }
+      }
+      return 0;
+  }
+  if (!lua_toboolean(L, -1)) { // Keep original.
+    lua_pop(L, 1);
+    luaL_addlstring(b, s + start, mlen);
+  } else if (lua_type(L, -1) == LUA_TSTRING ||
+      lua_type(L, -1) == LUA_TNUMBER) {
+    luaL_addvalue(b);
+  } else {
+    return "invalid replacement value";
+  }
+  return 0;
+}
+
+/* re:gsub(s, repl [, n]) -> string, count */
+static int lua_regex_gsub(lua_State *L)
+{
+  lv8_regex *r = regex_check(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  int t = lua_type(L, 3);
+  luaL_argcheck(L, t == LUA_TSTRING || t == LUA_TNUMBER ||
+      t == LUA_TTABLE || t == LUA_TFUNCTION, 3,
+      "string/function/table expected");
+  lua_Integer max = luaL_optinteger(L, 4, -1);
+  lua_settop(L, 3);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  char emsg[256];
+  const char *err = 0;
+  int count = 0, copied = 0;
+  {
+    HandleScope scope(ISOLATE);
+    Handle<Context> u = REF(Context, LV8_STATE->uctx);
+    u->Enter();
+    TryCatch exc;
+    Handle<String> subject = latin1_string(L, 2);
+    for (int pos = 0; !err && count != max && pos <= (int)len; count++) {
+      HandleScope iscope(ISOLATE);
+      Handle<Value> m = regex_run(r, subject, pos);
+      if (m.IsEmpty()) {
+        err = regex_error(exc, emsg, sizeof(emsg));
+        break;
+      }
+      if (m->IsNull())
+        break;
+      Handle<Array> a = m.As<Array>();
+      int start = a->Get(LITERAL("index"))->Int32Value();
+      int mlen = a->Get(0).As<String>()->Length();
+      luaL_addlstring(&b, s + copied, start - copied);
+      err = regex_repl(L, &b, a, s, start, mlen);
+      copied = start + mlen;
+      pos = mlen ? start + mlen : start + 1;
+    }
+    u->Exit();
+  }
+  if (err && !*err)
+    return lua_error(L); // Raised by repl function.
+  if (err)
+    return luaL_error(L, "regex: %s", err);
+  luaL_addlstring(&b, s + copied, len - copied);
+  luaL_pushresult(&b);
+  lua_pushinteger(L, count);
+  return 2;
+}
+
+/* re:__gc() */
+static int lua_regex_gc(lua_State *L)
+{
+  lv8_regex *r = (lv8_regex*)lua_touserdata(L, 1);
+  r->re.Reset();
+  r->exec.Reset();
+  return 0;
+}
+
+/* re:__tostring() */
+static int lua_regex_tostring(lua_State *L)
+{
+  lv8_regex *r = regex_check(L, 1);
+  if (r->re.IsEmpty())
+    return 0;
+  HandleScope scope(ISOLATE);
+  Handle<String> src = REF(RegExp, r->re)->GetSource();
+  lua_pushliteral(L, "lv8.regex: /");
+  push_latin1(L, src);
+  lua_pushliteral(L, "/");
+  lua_concat(L, 3);
+  return 1;
+}
+
+/* ArrayBuffer allocator. */
+class ab_allocator : public ArrayBuffer::Allocator {
+  public:
+  virtual void* Allocate(size_t length) {
+    void *data = calloc(length, 1);
+    return data;
+  }
+  virtual void* AllocateUninitialized(size_t length) {
+    void *data = malloc(length);
+    return data;
+  }
+  virtual void Free(void* data, size_t length) {
+    free(data);
+  }
+};
+
+/*
+ * ArrayBuffers are rather unfortunate in V8. Try to do our
+ * best to not clash with other ABs.
+ */
+static void
+pab_weak_callback(const WeakCallbackData<ArrayBuffer,
+    Persistent<ArrayBuffer> > &data)
+{
+  Persistent<ArrayBuffer> *pab = data.GetParameter();
+  free(data.GetValue()->ToObject()->GetAlignedPointerFromInternalField(1));
+  pab->Reset();
+  delete pab;
+}
+
+/* Externalize new ArrayBuffer */
+#define LV8_AB_MAGIC (void*)(0xDADE1330)
+static void *externalize_ab(Handle<ArrayBuffer> ab)
+{
+  ArrayBuffer::Contents contents = ab->Externalize();
+  void *ptr = contents.Data();
+  lv8_adopt_buf(ab, ptr);
+  return ptr;
+}
+
+/* Translate ArrayBuffer to pointer. */
+static inline void *get_arraybuffer(Handle<ArrayBuffer> ab)
+{
+  if (!ab->IsExternal()) {
+    return externalize_ab(ab);
+#ifndef NDEBUG
+  } else if (ab->GetAlignedPointerFromInternalField(0) != LV8_AB_MAGIC) {
+    ISOLATE->ThrowException( // Belongs to somebody else
+        Exception::Error(UTF8("Incompatible ArrayBuffer")));
+    return 0;
+#endif
+  } else {
+    return ab->GetAlignedPointerFromInternalField(1);
+  }
+}
+
+/*
+ * lv8.buffer(n | str) is userdata with plain malloc'd memory, which is
+ * seen by JS as (externalized, binding get_buf compatible) ArrayBuffer
+ * over the very same bytes. The ArrayBuffer is created on first
+ * crossing and maps back to the same userdata via LV8_IDENTITY. When
+ * Lua is done with the userdata, memory ownership passes to JS.
+ *
+ * Accessors take 0-based byte offsets and use native byte order, like
+ * typed arrays. buf:sub(i, j) follows string.sub().
+ */
+
+/* ArrayBuffer for buffer userdata. */
+static Handle<ArrayBuffer> buffer_js(lv8_buffer *b)
+{
+  if (b->ab.IsEmpty()) {
+    Handle<ArrayBuffer> ab = ArrayBuffer::New(ISOLATE, b->data, b->len);
+    ab->SetAlignedPointerInInternalField(0, LV8_AB_MAGIC);
+    ab->SetAlignedPointerInInternalField(1, b->data);
+    ab->SetHiddenValue(LITERAL(LV8_IDENTITY), External::New(ISOLATE, b));
+    b->ab.Reset(ISOLATE, ab);
+    return ab;
+  }
+  return REF(ArrayBuffer, b->ab);
+}
+
+/* Check argument is buffer userdata. */
+static lv8_buffer *check_buffer(lua_State *L, int idx)
+{
+  if (!lua_getmetatable(L, idx) || !lua_rawequal(L, -1, UV_BUFMT))
+    luaL_argerror(L, idx, "lv8.buffer");
+  lua_pop(L, 1);
+  return (lv8_buffer*)lua_touserdata(L, idx);
+}
+
+/* Check offset argument for access of n bytes. */
+static size_t buffer_off(lua_State *L, lv8_buffer *b, int arg, size_t n)
+{
+  lua_Integer off = luaL_checkinteger(L, arg);
+  luaL_argcheck(L, off >= 0 && (size_t)off + n <= b->len, arg,
+      "out of bounds");
+  return off;
+}
+
+/* lv8.buffer(n | str) */
+static int lua_buffer_new(lua_State *L)
+{
+  size_t n = 0;
+  const char *s = 0;
+  if (lua_type(L, 1) == LUA_TSTRING)
+    s = lua_tolstring(L, 1, &n);
+  else
+    n = luaL_checkinteger(L, 1);
+  lv8_buffer *b = (lv8_buffer*)lua_newuserdata(L, sizeof(*b));
+  memset(b, 0, sizeof(*b));
+  b->data = (char*)(s ? malloc(n ? n : 1) : calloc(n ? n : 1, 1));
+  if (!b->data)
+    luaL_error(L, "not enough memory");
+  if (s)
+    memcpy(b->data, s, n);
+  b->len = n;
+  lua_pushvalue(L, UV_BUFMT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+/* Lua is done with buffer, JS may still hold it. */
+static int lua_buffer_gc(lua_State *L)
+{
+  lv8_buffer *b = (lv8_buffer*)lua_touserdata(L, 1);
+  if (b->ab.IsEmpty()) {
+    free(b->data);
+    return 0;
+  }
+  HandleScope scope(ISOLATE);
+  Handle<ArrayBuffer> ab = REF(ArrayBuffer, b->ab);
+  ab->SetHiddenValue(LITERAL(LV8_IDENTITY), Undefined(ISOLATE));
+  lv8_adopt_buf(ab, b->data); // Freed once JS loses it too.
+  b->ab.Reset();
+  return 0;
+}
+
+static int lua_buffer_len(lua_State *L)
+{
+  lua_pushinteger(L, check_buffer(L, 1)->len);
+  return 1;
+}
+
+static int lua_buffer_tostring(lua_State *L)
+{
+  lv8_buffer *b = check_buffer(L, 1);
+  lua_pushfstring(L, "lv8.buffer<%d>: %p", (int)b->len, b->data);
+  return 1;
+}
+
+/* buf:sub(i, j) -> string */
+static int lua_buffer_sub(lua_State *L)
+{
+  lv8_buffer *b = check_buffer(L, 1);
+  lua_Integer l = b->len;
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  if (i < 0) i += l + 1;
+  if (i < 1) i = 1;
+  if (j < 0) j += l + 1;
+  if (j > l) j = l;
+  if (i > j)
+    lua_pushliteral(L, "");
+  else
+    lua_pushlstring(L, b->data + i - 1, j - i + 1);
+  return 1;
+}
+
+/* buf:put(off, str) -> buf */
+static int lua_buffer_put(lua_State *L)
+{
+  lv8_buffer *b = check_buffer(L, 1);
+  size_t n;
+  const char *s = luaL_checklstring(L, 3, &n);
+  memcpy(b->data + buffer_off(L, b, 2, n), s, n);
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Typed accessors, buf:get_u32(off), buf:set_u32(off, v) etc. */
+#define BUF_TYPES(_) \
+  _(u8, uint8_t) _(i8, int8_t) _(u16, uint16_t) _(i16, int16_t) \
+  _(u32, uint32_t) _(i32, int32_t) _(f32, float) _(f64, double)
+#define BUF_ACCESSORS(n, t) \
+  static int lua_buffer_get_##n(lua_State *L) { \
+    lv8_buffer *b = check_buffer(L, 1); \
+    t v; \
+    memcpy(&v, b->data + buffer_off(L, b, 2, sizeof(t)), sizeof(t)); \
+    lua_pushnumber(L, v); \
+    return 1; \
+  } \
+  static int lua_buffer_set_##n(lua_State *L) { \
+    lv8_buffer *b = check_buffer(L, 1); \
+    t v = (t)luaL_checknumber(L, 3); \
+    memcpy(b->data + buffer_off(L, b, 2, sizeof(t)), &v, sizeof(t)); \
+    return 0; \
+  }
+BUF_TYPES(BUF_ACCESSORS)
+
+/*
+ * Lazy strings. With lv8.lazystrings(n), JS strings of n or more
+ * characters cross into Lua as handles which keep the V8 string and
+ * only transcode on tostring(), #, .. or comparison (the result is
+ * cached in a weak keyed registry table). Passing a handle back to JS
+ * is free.
+ *
+ * Handles are userdata, not strings: lazy == "plain" is always false
+ * (Lua only calls __eq for two userdata), type() says "userdata" and
+ * there are no string methods (s:sub). Call tostring() first where a
+ * real string is needed.
+ */
+static char lv8_lazy_key; // Registry key of the transcoded cache.
+
+/* lv8.lazystrings([n]) -> previous threshold; 0 or nil disables. */
+static int lua_lazystrings(lua_State *L)
+{
+  lv8_state *state = LV8_STATE;
+  lua_Integer n = luaL_optinteger(L, 1, 0);
+  luaL_argcheck(L, n >= 0, 1, "negative threshold");
+  lua_pushinteger(L, state->lazystr);
+  state->lazystr = n;
+  return 1;
+}
+
+/* Replace lazy string at idx by Lua string. */
+static void lazy_materialize(lua_State *L, int idx)
+{
+  if (!lua_getmetatable(L, idx))
+    return;
+  bool lazy = lua_rawequal(L, -1, UV_STRMT);
+  lua_pop(L, 1);
+  if (!lazy)
+    return;
+  idx = lua_absindex(L, idx);
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &lv8_lazy_key);
+  if (lua_isnil(L, -1)) { // Weak keyed, handle -> string.
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &lv8_lazy_key);
+  }
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) { // Not transcoded yet.
+    lua_pop(L, 1);
+    HandleScope scope(ISOLATE);
+    push_string(L, REF(String, ((lv8_jsstring*)lua_touserdata(L, idx))->str));
+    lua_pushvalue(L, idx);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_replace(L, idx);
+  lua_pop(L, 1);
+}
+
+static int lua_lazy_tostring(lua_State *L)
+{
+  lazy_materialize(L, 1);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int lua_lazy_len(lua_State *L)
+{
+  lazy_materialize(L, 1);
+  lua_pushinteger(L, lua_rawlen(L, 1));
+  return 1;
+}
+
+static int lua_lazy_concat(lua_State *L)
+{
+  lazy_materialize(L, 1);
+  lazy_materialize(L, 2);
+  lua_settop(L, 2);
+  lua_concat(L, 2);
+  return 1;
+}
+
+/* Two handles compare by V8 without transcoding. */
+static int lua_lazy_eq(lua_State *L)
+{
+  bool eq = false;
+  if (lua_getmetatable(L, 1) && lua_getmetatable(L, 2) &&
+      lua_rawequal(L, -1, UV_STRMT) && lua_rawequal(L, -2, UV_STRMT)) {
+    HandleScope scope(ISOLATE);
+    lv8_jsstring *a = (lv8_jsstring*)lua_touserdata(L, 1);
+    lv8_jsstring *b = (lv8_jsstring*)lua_touserdata(L, 2);
+    eq = REF(String, a->str)->StrictEquals(REF(String, b->str));
+  }
+  lua_pushboolean(L, eq);
+  return 1;
+}
+
+static int lua_lazy_lt(lua_State *L)
+{
+  lazy_materialize(L, 1);
+  lazy_materialize(L, 2);
+  lua_pushboolean(L, lua_compare(L, 1, 2, LUA_OPLT));
+  return 1;
+}
+
+static int lua_lazy_le(lua_State *L)
+{
+  lazy_materialize(L, 1);
+  lazy_materialize(L, 2);
+  lua_pushboolean(L, lua_compare(L, 1, 2, LUA_OPLE));
+  return 1;
+}
+
+static int lua_lazy_gc(lua_State *L)
+{
+  ((lv8_jsstring*)lua_touserdata(L, 1))->str.Reset();
+  return 0;
+}
+
+/* Install Lua proxy interceptors on tpl. */
+static void proxy_handlers(lua_State *L, Handle<ObjectTemplate> tpl,
+    NamedPropertyGetterCallback get, NamedPropertySetterCallback set)
+{
+  tpl->SetNamedPropertyHandler( // Named properties.
+      get, set, 0,
+      lv8_delprop_cb, lv8_enumprop_cb,
+      External::New(ISOLATE, L));
+  tpl->SetIndexedPropertyHandler( // Indexed properties.
+      lv8_getidx_cb, lv8_setidx_cb, 0,
+      lv8_delidx_cb, lv8_enumidx_cb,
+      External::New(ISOLATE, L));
+  tpl->SetCallAsFunctionHandler(lv8_js2lua_call, External::New(ISOLATE, L));
+}
+
+/*
+ * Userdata layouts. lv8.layout(mt, {x = "f64@0", id = "u32@8"}) maps
+ * fields of C structs behind userdata with metatable mt. JS proxies of
+ * such userdata use a derived template (still PROXY instances) whose
+ * named interceptor loads/stores mapped fields straight from userdata
+ * memory, and falls back to Lua for everything else.
+ *
+ * Internal fields of layout proxies are: 0 wrapper, 1 userdata memory,
+ * 2 lv8_layout. Memory stays valid as the wrapper anchors the userdata.
+ * Applies to userdata first seen by JS after registration, and only if
+ * the userdata is large enough. Layouts live as long as the state, just
+ * like the templates backing them.
+ */
+enum {
+#define LT_ENUM(n, t) LT_##n,
+  BUF_TYPES(LT_ENUM)
+  LT_MAX
+};
+static const char *const lt_names[] = {
+#define LT_NAME(n, t) #n,
+  BUF_TYPES(LT_NAME)
+};
+static const uint8_t lt_sizes[] = {
+#define LT_SIZE(n, t) sizeof(t),
+  BUF_TYPES(LT_SIZE)
+};
+#define LT_FIELD(type, off) (((type) << 24) | (off)) // Field descriptor.
+#define LT_MAXOFF 0xffffff
+
+static char lv8_layout_key; // Registry key of mt -> layout map.
+
+/* Layout of userdata at idx, if any. */
+static lv8_layout *layout_find(lua_State *L, int idx)
+{
+  lv8_layout *lt = 0;
+  if (!lua_getmetatable(L, idx))
+    return 0;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &lv8_layout_key);
+  if (lua_istable(L, -1)) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, -2);
+    lt = (lv8_layout*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  if (lt && lua_rawlen(L, idx) < lt->size)
+    lt = 0; // Too small, plain proxy.
+  return lt;
+}
+
+/* Mapped field of layout proxy, or empty handle. */
+static Handle<Value> layout_field(Handle<Object> h, Local<String> prop,
+    char **p)
+{
+  if (!h->GetAlignedPointerFromInternalField(0))
+    return Handle<Value>(); // Dead, memory no longer anchored.
+  lv8_layout *lt = (lv8_layout*)h->GetAlignedPointerFromInternalField(2);
+  Handle<Value> f = REF(Object, lt->fields)->GetRealNamedProperty(prop);
+  if (!f.IsEmpty())
+    *p = (char*)h->GetAlignedPointerFromInternalField(1)
+      + (f->Uint32Value() & LT_MAXOFF);
+  return f;
+}
+
+/* Read holder.prop, from memory if mapped. */
+static void lv8_layout_getprop_cb(Local<String> prop,
+    const PropertyCallbackInfo<Value> &info)
+{
+  char *p;
+  Handle<Value> f = layout_field(info.Holder(), prop, &p);
+  if (f.IsEmpty())
+    return lv8_getprop_cb(prop, info);
+  switch (f->Uint32Value() >> 24) {
+#define LT_LOAD(n, t) \
+    case LT_##n: { t v; memcpy(&v, p, sizeof(t)); \
+      info.GetReturnValue().Set((double)v); return; }
+    BUF_TYPES(LT_LOAD)
+  }
+}
+
+/* Set holder.prop = val, to memory if mapped. */
+static void lv8_layout_setprop_cb(Local<String> prop, Local<Value> val,
+    const PropertyCallbackInfo<Value> &info)
+{
+  char *p;
+  Handle<Value> f = layout_field(info.Holder(), prop, &p);
+  if (f.IsEmpty())
+    return lv8_setprop_cb(prop, val, info);
+  double d = val->NumberValue();
+  switch (f->Uint32Value() >> 24) {
+#define LT_STORE(n, t) \
+    case LT_##n: { t v = (t)d; memcpy(p, &v, sizeof(t)); break; }
+    BUF_TYPES(LT_STORE)
+  }
+  info.GetReturnValue().Set(val);
+}
+
+/* Parse "type@offset" field spec at -1, key at -2. */
+static bool layout_spec(lua_State *L, int *type, unsigned *off)
+{
+  char tname[8];
+  const char *spec = lua_tostring(L, -1);
+  if (lua_type(L, -2) != LUA_TSTRING || !spec ||
+      sscanf(spec, "%7[a-z0-9]@%u", tname, off) != 2 || *off > LT_MAXOFF)
+    return false;
+  for (*type = 0; *type < LT_MAX; (*type)++)
+    if (!strcmp(tname, lt_names[*type]))
+      return true;
+  return false;
+}
+
+/* lv8.layout(mt, spec) */
+static int lua_layout(lua_State *L)
+{
+  int type;
+  unsigned off;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_pushnil(L);
+  while (lua_next(L, 2)) { // Validate before touching V8.
+    if (!layout_spec(L, &type, &off))
+      return luaL_error(L, "invalid layout field '%s'", lua_tostring(L, -2));
+    lua_pop(L, 1);
+  }
+  checkstate(L);
+  lv8_layout *lt = new lv8_layout();
+  memset(lt, 0, sizeof(*lt));
+  {
+    HandleScope scope(ISOLATE);
+    Handle<Context> uctx = Local<Context>::New(ISOLATE, LV8_STATE->uctx);
+    uctx->Enter();
+    Handle<Object> fields = Object::New(ISOLATE);
+    fields->SetPrototype(Null(ISOLATE));
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      layout_spec(L, &type, &off);
+      fields->Set(UTF8(lua_tostring(L, -2)),
+          Uint32::NewFromUnsigned(ISOLATE, LT_FIELD(type, off)));
+      if (off + lt_sizes[type] > lt->size)
+        lt->size = off + lt_sizes[type];
+      lua_pop(L, 1);
+    }
+    lt->fields.Reset(ISOLATE, fields);
+    uctx->Exit();
+
+    Handle<FunctionTemplate> tpl = FunctionTemplate::New(ISOLATE);
+    tpl->Inherit(PROXY); // Still passes for lv8_unwrap_js().
+    Handle<ObjectTemplate> itpl = tpl->InstanceTemplate();
+    itpl->SetInternalFieldCount(3);
+    proxy_handlers(L, itpl, lv8_layout_getprop_cb, lv8_layout_setprop_cb);
+    lt->tpl.Reset(ISOLATE, tpl);
+  }
+
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &lv8_layout_key);
+  if (lua_isnil(L, -1)) { // Weak keyed, mt -> layout.
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &lv8_layout_key);
+  }
+  lua_pushvalue(L, 1);
+  lua_pushlightuserdata(L, lt);
+  lua_rawset(L, -3);
+  return 0;
+}
+
+/* Initialize global state. */
+static void checkstate(lua_State *L)
+{
+  lv8_state *state = LV8_STATE;
+  if (state->initialized) return;
+#if !NON_POSIX
+  if (const char *pm = getenv(LV8_PERFMAP_ENV))
+    lv8_perfmap_start(!strcmp(pm, "jitdump"));
+#endif
+  V8::SetArrayBufferAllocator(new ab_allocator());
 
   state->initialized = 1;
   HandleScope scope(ISOLATE);
@@ -751,26 +3352,32 @@ static void checkstate(lua_State *L)
 
   Handle<ObjectTemplate> tpl = proxy->InstanceTemplate();
   tpl->SetInternalFieldCount(1); // Points to wrapped lua object.
-  tpl->SetNamedPropertyHandler( // Named properties.
-      lv8_getprop_cb, lv8_setprop_cb, 0,
-      lv8_delprop_cb, lv8_enumprop_cb,
-      External::New(ISOLATE, L));
-  tpl->SetIndexedPropertyHandler( // Indexed properties.
-      lv8_getidx_cb, lv8_setidx_cb, 0,
-      lv8_delidx_cb, 0,
-      External::New(ISOLATE, L));
-  tpl->SetCallAsFunctionHandler(lv8_js2lua_call, External::New(ISOLATE, L));
+  proxy_handlers(L, tpl, lv8_getprop_cb, lv8_setprop_cb);
 
   /* We might not have proper context, but
    * the following code needs it. */
   Handle<Context> tmp = Context::New(ISOLATE);
+  state->uctx.Reset(ISOLATE, tmp); // Keep it for utility objects.
   tmp->Enter();
+  Handle<Object> sbgen = Object::New(ISOLATE);
+  sbgen->SetPrototype(Null(ISOLATE));
+  state->sbgen.Reset(ISOLATE, sbgen);
 #if LV8_BINDING
   lv8_wrap_js2lua(L, lv8_binding_init(L)->NewInstance());
   lua_setfield(L, UV_LIB, "binding");
-  tmp->Exit();
 #endif
+  tmp->Exit();
+}
+
+/* Runs C api request inside frame which has our upvalues. */
+static int lv8_capi_trampoline(lua_State *L)
+{
+  void (*fn)(lua_State *, void *);
+  *(void**)&fn = lua_touserdata(L, 1);
+  fn(L, lua_touserdata(L, 2));
+  return 0;
 }
+static char lv8_capi_key; // Registry key of the trampoline.
 
 /* Wrapper for lv8 table __call. */
 static int __call_create_context(struct lua_State *L) {
@@ -791,13 +3398,115 @@ static const struct luaL_Reg lv8_object_mt[] = {
   { 0, 0 }
 };
 
+/*
+ * lv8.bufferptr(buf) -> lightuserdata, len, pin
+ * The pointer is valid for as long as 'pin' is reachable from Lua; pin
+ * anchors buf (and so the JS ArrayBuffer behind a proxy) in its
+ * uservalue. Keep it next to the pointer, e.g. in the FFI cdata owner.
+ */
+static int lua_buffer_ptr(lua_State *L)
+{
+  size_t len = 0;
+  void *p = lv8_buffer_data(L, 1, &len);
+  luaL_argcheck(L, p, 1, "lv8.buffer or JS ArrayBuffer expected");
+  lua_pushlightuserdata(L, p);
+  lua_pushinteger(L, len);
+  lua_newuserdata(L, 0);
+  lua_createtable(L, 1, 0); // Uservalue must be a table on 5.2.
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 3;
+}
+
+/* Metatable (and methods) for UV_BUFMT. */
+#define BUF_REG(n, t) \
+  { "get_" #n, lua_buffer_get_##n }, { "set_" #n, lua_buffer_set_##n },
+static const struct luaL_Reg lv8_buffer_mt[] = {
+  { "__gc",       lua_buffer_gc },      // Pass memory to JS (or free).
+  { "__len",      lua_buffer_len },     // Size in bytes.
+  { "__tostring", lua_buffer_tostring },
+  { "sub",        lua_buffer_sub },     // Copy out range as string.
+  { "put",        lua_buffer_put },     // Copy string in at offset.
+  BUF_TYPES(BUF_REG)
+  { 0, 0 }
+};
+
+/* Metatable for UV_STRMT. */
+static const struct luaL_Reg lv8_string_mt[] = {
+  { "__gc",       lua_lazy_gc },
+  { "__tostring", lua_lazy_tostring },  // Transcode (once).
+  { "__len",      lua_lazy_len },
+  { "__concat",   lua_lazy_concat },
+  { "__eq",       lua_lazy_eq },        // Compared by V8.
+  { "__lt",       lua_lazy_lt },
+  { "__le",       lua_lazy_le },
+  { 0, 0 }
+};
+
+/* lv8.gc, callable. */
+static const struct luaL_Reg lv8_gc_lib[] = {
+  { "drain",    lua_gc_drain },       // Release objects JS collected.
+  { "step",     lua_gc_step },        // Bounded idle work.
+  { "__call",   lua_gc_call },        // Force gc.
+  { 0, 0 }
+};
+
+/* Metatable for UV_REMT, methods live in mt itself. */
+static const struct luaL_Reg lv8_regex_mt[] = {
+  { "exec",     lua_regex_exec },     // Next match.
+  { "gmatch",   lua_regex_gmatch },   // Iterate matches.
+  { "gsub",     lua_regex_gsub },     // Replace matches.
+  { "__gc",     lua_regex_gc },
+  { "__tostring", lua_regex_tostring },
+  { 0, 0 }
+};
+
+/* lv8.json */
+static const struct luaL_Reg lv8_json_lib[] = {
+  { "decode",   lua_json_decode },    // Parse with V8 into Lua tables.
+  { "encode",   lua_json_encode },    // Serialize, optionally streamed.
+  { 0, 0 }
+};
+
+#if !NON_POSIX
+/* lv8.trace */
+static const struct luaL_Reg lv8_trace_lib[] = {
+  { "now",      lua_trace_now },      // ms since trace epoch.
+  { "mark",     lua_trace_mark },     // Instant.
+  { "measure",  lua_trace_measure },  // Span since start.
+  { "drain",    lua_trace_drain },    // Chrome trace JSON (or text).
+  { 0, 0 }
+};
+#endif
+
 /* Library. */
 static const struct luaL_Reg lv8_lib[] = {
   { "flags",    lua_v8_flags},          // Set V8 flags.
-  { "gc",       lua_force_gc},        // Force gc.
   { "new",      lv8_create_instance },// Call 'new' in JS to construct instance.
   { "sandbox",  lv8_create_sandbox }, // Create sandbox.
+  { "touch",    lua_sb_touch },       // Invalidate cached sandbox globals.
+  { "buffer",   lua_buffer_new },     // Memory shared with JS.
+  { "bufferptr", lua_buffer_ptr },    // Raw memory of buffer, for C/FFI.
+  { "lazystrings", lua_lazystrings }, // Pass long JS strings as handles.
+  { "iter",     lua_obj_iter },       // Batched iteration of JS iterables.
+  { "layout",   lua_layout },         // Map userdata fields for JS.
+  { "fn",       lua_fn },             // Typed Lua function export.
+  { "regex",    lua_regex },          // Irregexp over Lua strings.
+  { "pressure", lua_pressure },       // React to cgroup memory pressure.
+  { "configure", lua_configure },     // Isolate resource constraints.
+  { "stats",    lua_stats },          // Heap statistics and constraints.
+#if !NON_POSIX
+  { "platform", lua_platform },       // Background threads and counters.
+  { "perfmap",  lua_perfmap },        // JIT symbols for perf.
+  { "profile",  lua_profile },        // Mixed Lua/JS sampling profiler.
+  { "census",   lua_census },         // Live proxies by allocation site.
+#endif
+  { "scope",    lua_scope },          // Request scoped proxies.
+  { "escape",   lua_escape },         // Keep proxy past scope.
   { "context",  lv8_create_context }, // Create JS context.
+  { "checkpoint", lua_ctx_checkpoint }, // Save context globals.
+  { "rewind",   lua_ctx_rewind },     // Restore saved context globals.
   { "__call",   __call_create_context }, // Ditto.
   { 0, 0 }
 };
@@ -810,6 +3519,116 @@ void lv8_push(lua_State *L, lv8_object *v)
   lua_pushuserdata(L, v);
 }
 
+/* Call fn(L, ud) from within lv8 trampoline (for C api callers). */
+int lv8_capi_invoke(lua_State *L, void (*fn)(lua_State *, void *), void *ud)
+{
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &lv8_capi_key);
+  lua_pushlightuserdata(L, *(void**)&fn);
+  lua_pushlightuserdata(L, ud);
+  return lua_pcall(L, 2, 0, 0);
+}
+
+/* lv8 state of L, 0 if lv8 was not opened in it. */
+lv8_state *lv8_state_get(lua_State *L)
+{
+  lv8_state *state = 0;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &lv8_capi_key); // Holds the UVs.
+  if (lua_isfunction(L, -1) && lua_getupvalue(L, -1, 2)) {
+    state = (lv8_state*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return state;
+}
+
+/* Release d at next safepoint of state, callable from weak callbacks. */
+void lv8_defer(lv8_state *state, lv8_deferred *d)
+{
+  DEAD_PUSH(&state->deferred, d, dnext);
+}
+
+/* Translate ArrayBuffer (or ArrayBufferView) to pointer and length. */
+void *lv8_get_buf(Handle<Object> b, size_t *len)
+{
+  if (b->IsArrayBuffer()) {
+    Handle<ArrayBuffer> ab = b.As<ArrayBuffer>();
+    if (len) *len = ab->ByteLength();
+    return get_arraybuffer(ab);
+  }
+  Handle<ArrayBufferView> abv = b.As<ArrayBufferView>();
+  if (len) *len = abv->ByteLength();
+  return (void*)(((char*)get_arraybuffer(abv->Buffer()))
+      + abv->ByteOffset());
+}
+
+/* Take ownership of external ArrayBuffer memory (freed on JS GC). */
+void lv8_adopt_buf(Handle<ArrayBuffer> ab, void *ptr)
+{
+  ab->SetAlignedPointerInInternalField(0, LV8_AB_MAGIC);
+  ab->SetAlignedPointerInInternalField(1, ptr);
+  Persistent<ArrayBuffer> *pab = new Persistent<ArrayBuffer>();
+  pab->Reset(ISOLATE, ab);
+  pab->SetWeak(pab, pab_weak_callback);
+  pab->MarkIndependent();
+}
+
+static void scope_enter_aux(lua_State *L, void *ud)
+{
+  scope_enter(L);
+}
+
+static void scope_leave_aux(lua_State *L, void *ud)
+{
+  scope_leave(L);
+}
+
+/* C equivalent of lv8.scope(), calls must pair up. */
+void lv8_scope_enter(lua_State *L)
+{
+  lv8_capi_invoke(L, scope_enter_aux, 0);
+}
+
+void lv8_scope_leave(lua_State *L)
+{
+  lv8_capi_invoke(L, scope_leave_aux, 0);
+}
+
+/*
+ * Memory of buffer at idx, either lv8.buffer or proxy of JS ArrayBuffer
+ * (or view), NULL otherwise (or if lv8 is not loaded yet). Usable from
+ * any Lua C function. Memory is pinned for as long as the value at idx
+ * stays reachable from Lua, the caller has to anchor it.
+ */
+void *lv8_buffer_data(lua_State *L, int idx, size_t *len)
+{
+  void *p = 0;
+  idx = lua_absindex(L, idx);
+  if (!lua_getmetatable(L, idx))
+    return 0;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &lv8_capi_key); // Holds the UVs.
+  if (!lua_isfunction(L, -1)) { // luaopen_lv8 did not run.
+    lua_pop(L, 2);
+    return 0;
+  }
+  lua_getupvalue(L, -1, 5); // BUFMT
+  lua_getupvalue(L, -2, 4); // OBJMT
+  if (lua_rawequal(L, -4, -2)) {
+    lv8_buffer *b = (lv8_buffer*)lua_touserdata(L, idx);
+    if (len) *len = b->len;
+    p = b->data;
+  } else if (lua_rawequal(L, -4, -1)) {
+    lv8_object *o = (lv8_object*)lua_touserdata(L, idx);
+    if (o->type == LV8_OBJ_JS && !o->object.IsEmpty()) {
+      HandleScope scope(ISOLATE);
+      Handle<Object> b = OREF(o);
+      if (b->IsArrayBuffer() || b->IsArrayBufferView())
+        p = lv8_get_buf(b, len);
+    }
+  }
+  lua_pop(L, 4);
+  return p;
+}
+
 /* Construct object as 'new arg1(arg2...)' */
 int lv8_create_instance(lua_State *L)
 {
@@ -857,6 +3676,7 @@ void lv8_wrap_js2lua(lua_State *L, Handle<Object> o)
   obj->object.Reset(ISOLATE, o); // Anchor until lua_obj_gc kills it.
   lua_pushvalue(L, UV_OBJMT); // Associate obj mt.
   lua_setmetatable(L, -2);
+  LV8_CENSUS(track(L, obj));
 }
 
 /* Check if object o is a context object (ie not a proxy). */
@@ -866,14 +3686,15 @@ bool lv8_is_js_context(Handle<Object> o)
 }
 
 /* Query if given JS object is a proxy for actual Lua object
- * or sandbox (not context by default). */
+ * or sandbox (not context by default). LV8_DEAD_PROXY if it was,
+ * but its lv8.scope() has exited. */
 lv8_context *lv8_unwrap_js(lua_State *L, Handle<Object> o, bool context)
 {
   if (!PROXY->HasInstance(o) && (!context ||
         !lv8_is_js_context(o)))
     return 0;
   lv8_context *c = (lv8_context*)o->GetAlignedPointerFromInternalField(0);
-  return c;
+  return c ? c : LV8_DEAD_PROXY;
 }
 
 /* Copy attributes of o to dst. */
@@ -882,7 +3703,10 @@ bool lv8_shallow_copy(lua_State *L, Handle<Object> dst, Handle<Object> o)
   HandleScope scope(ISOLATE);
   if (o.IsEmpty() || o->IsUndefined() || !o->IsObject())
     return false;
-  if (lv8_object *c = lv8_unwrap_js(L, o)) { // Sandbox or proxy for Lua object
+  lv8_object *c = lv8_unwrap_js(L, o);
+  if (c == LV8_DEAD_PROXY)
+    return false;
+  if (c) { // Sandbox or proxy for Lua object
     if (c->type == LV8_OBJ_LUA)
       return lv8_shallow_copy_from_lua(L, dst, -1); // Copy it
     assert(c->type == LV8_OBJ_SB || c->type == LV8_OBJ_CTX);
@@ -940,6 +3764,7 @@ struct lv8_context *lv8_context_factory(struct lua_State *L)
   lv8_context *ctx = (lv8_context*)lua_newuserdata(L, sizeof(*ctx));
   memset(ctx, 0, sizeof(*ctx));
   ctx->type = LV8_OBJ_CTX;
+  ctx->L = main_thread(L);
   /* INVARIANT #1 */
   lua_pushvalue(L, UV_OBJMT); // Associate obj mt.
   lua_setmetatable(L, -2);
@@ -950,7 +3775,11 @@ struct lv8_context *lv8_context_factory(struct lua_State *L)
   ctx->context.Reset(ISOLATE, c);
   gl->SetAlignedPointerInInternalField(0, (void*)ctx);
   ctx->object.Reset(ISOLATE, gl);
-  ctx->object.SetWeak(L, js_weak_object);
+  ctx->object.SetWeak(LV8_STATE, js_weak_object);
+  c->Enter(); // For lv8.checkpoint(), before user code can touch it.
+  gl->SetHiddenValue(LITERAL(LV8_GOPN), gl->Get(LITERAL("Object"))
+      ->ToObject()->Get(LITERAL("getOwnPropertyNames")));
+  c->Exit();
 
   return ctx;
 }
@@ -978,6 +3807,7 @@ struct lv8_context *lv8_sandbox_factory(lua_State *L, int idx)
     lv8_context *ctx = (lv8_context*)lua_newuserdata(L, sizeof(*ctx));
     memset(ctx, 0, sizeof(*ctx));
     ctx->type = LV8_OBJ_SB;
+    ctx->L = main_thread(L);
     lua_pushvalue(L, UV_OBJMT); // Associate CTX mt.
     lua_setmetatable(L, -2);
 
@@ -986,18 +3816,21 @@ struct lv8_context *lv8_sandbox_factory(lua_State *L, int idx)
     Handle<Object> gl = c->Global()->GetPrototype()->ToObject();
     gl->SetAlignedPointerInInternalField(0, (void*)ctx);
     ctx->object.Reset(ISOLATE, gl); // Intercept.
-    ctx->object.SetWeak(L, js_weak_object);
+    ctx->object.SetWeak(LV8_STATE, js_weak_object);
     lua_pushlightuserdata(L, ctx);
     lua_pushvalue(L, idx);
     lua_rawset(L, UV_REFTAB); // Link original table.
     return ctx;
 }
 
-/* Construct new JS sandbox. */
+/* Construct new JS sandbox, lv8.sandbox(t, cached). */
 int lv8_create_sandbox(struct lua_State *L)
 {
   luaL_checkany(L, 1);
-  lv8_sandbox_factory(L, 1);
+  lv8_context *c = lv8_sandbox_factory(L, 1);
+  c->cached = lua_toboolean(L, 2);
+  if (c->cached)
+    LV8_STATE->sbcaching = 1;
   return 1;
 }
 
@@ -1007,6 +3840,29 @@ int luaclose_lv8(lua_State *L)
   lv8_state *state = (lv8_state*)lua_touserdata(L, 1);
   state->proxy.Reset(); // Should have no refs.
   state->gtpl.Reset(); // Should have no refs.
+  state->sbgen.Reset();
+  state->uctx.Reset();
+  for (int i = 0; i < 2; i++) { // Dead Lua proxies never drained.
+    lv8_object *l = i ? state->backlog : state->dead;
+    while (lv8_object *v = l) {
+      l = v->qnext;
+      LV8_CENSUS(forget(v));
+      if (v->type == LV8_OBJ_LUA && !v->scoped)
+        delete v;
+    }
+  }
+  while (lv8_arena *a = state->spare) {
+    state->spare = a->next;
+    delete a;
+  }
+  while (lv8_deferred *d = state->deferred) {
+    state->deferred = d->dnext;
+    d->release(0, d);
+  }
+  while (lv8_extstr *s = state->deadext) { // Refs went with registry.
+    state->deadext = s->next;
+    delete s;
+  }
   return 0;
 }
 
@@ -1024,11 +3880,21 @@ static void *fakealloc(void *ud, void *ptr, size_t o, size_t n)
 }
 #endif
 
+/* Register functions into table at idx, with UVs #1..#nuv. */
+static void setfuncs_uv(lua_State *L, int idx, const luaL_Reg *l, int nuv)
+{
+  lua_pushvalue(L, idx);
+  for (int i = 1; i <= nuv; i++) // Dup UVs.
+    lua_pushvalue(L, i);
+  luaL_setfuncs(L, l, nuv);
+  lua_pop(L, 1);
+}
+
 /* main(). */
 int luaopen_lv8(lua_State *L)
 {
   V8::SetFlagsFromString(LV8_DEFAULT_FLAGS, sizeof(LV8_DEFAULT_FLAGS)-1);
-#define N_UV 4
+  cgroup_heap_flags();
 
 #if LV8_NEED_FINHACK
   void *ud;
@@ -1056,20 +3922,54 @@ int luaopen_lv8(lua_State *L)
   lua_setfield(L, -2, "__gc");
   lua_setmetatable(L, 2); // Pops mt.
 
-  /* UV #3-#4: REFTAB, OBJMT. */
+  /* UV #3-#7: REFTAB, OBJMT, BUFMT, STRMT, REMT. */
   for (int i = 3; i <= N_UV; i++)
     lua_newtable(L);
 
   /* UV #4: Configure OBJMT. */
-  for (int i = 1; i <= N_UV; i++) // Dup UVs.
-    lua_pushvalue(L, i);
-  luaL_setfuncs(L, lv8_object_mt, N_UV);
+  setfuncs_uv(L, 4, lv8_object_mt, N_UV);
+
+  /* UV #5: Configure BUFMT, methods live in mt itself. */
+  setfuncs_uv(L, 5, lv8_buffer_mt, N_UV);
+  lua_pushvalue(L, 5);
+  lua_setfield(L, 5, "__index");
+
+  /* UV #6: Configure STRMT. */
+  setfuncs_uv(L, 6, lv8_string_mt, N_UV);
+
+  /* UV #7: Configure REMT, like BUFMT. */
+  setfuncs_uv(L, 7, lv8_regex_mt, N_UV);
+  lua_pushvalue(L, 7);
+  lua_setfield(L, 7, "__index");
+
+  /* lv8.gc, its own metatable like the library. */
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setmetatable(L, -2);
+  setfuncs_uv(L, lua_gettop(L), lv8_gc_lib, N_UV);
+  lua_setfield(L, 1, "gc");
+  lua_newtable(L);
+  setfuncs_uv(L, lua_gettop(L), lv8_json_lib, N_UV);
+  lua_pushlightuserdata(L, 0);
+  lua_setfield(L, -2, "null");
+  lua_setfield(L, 1, "json");
+#if !NON_POSIX
+  lua_newtable(L);
+  setfuncs_uv(L, lua_gettop(L), lv8_trace_lib, N_UV);
+  lua_setfield(L, 1, "trace");
+#endif
 
   lua_pushvalue(L, 1);
   lua_insert(L, 1);
   assert(lua_gettop(L) == N_UV+1);
 
-  /* Library methods. Consume #1..#5 */
+  /* C api trampoline, needs copy of UVs too. */
+  for (int i = 2; i <= N_UV+1; i++)
+    lua_pushvalue(L, i);
+  lua_pushcclosure(L, lv8_capi_trampoline, N_UV);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &lv8_capi_key);
+
+  /* Library methods. Consume #1..#7 */
   luaL_setfuncs(L, lv8_lib, N_UV);
   return 1;
 }
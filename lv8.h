@@ -25,8 +25,12 @@
  * poking V8 guts (eg. only static linking this library).
  * For C++ you may want to use lv8.hpp */
 #ifndef LV8_EXTERN
+#if defined(__GNUC__)
+#define LV8_EXTERN __attribute__((visibility("default")))
+#else
 #define LV8_EXTERN
 #endif
+#endif
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -40,6 +44,44 @@ LV8_EXTERN int lv8_create_sandbox(struct lua_State *L);
 LV8_EXTERN struct lv8_context *lv8_context_factory(lua_State *L);
 LV8_EXTERN struct lv8_context *lv8_sandbox_factory(lua_State *L, int idx);
 LV8_EXTERN struct lv8_context *lv8_unwrap_lua(lua_State *L, int idx);
+LV8_EXTERN void *lv8_buffer_data(lua_State *L, int idx, size_t *len);
+LV8_EXTERN void lv8_scope_enter(lua_State *L);
+LV8_EXTERN void lv8_scope_leave(lua_State *L);
+
+/*
+ * Direct C api. Values are passed around as lv8_value handles and go
+ * straight between C and V8, without detour through the Lua stack.
+ * NULL handle stands for undefined. Every handle returned must be
+ * released with lv8_free(). Calls which throw return LV8_TERROR handle,
+ * lv8_tolstring() of which yields the JS stack trace.
+ */
+typedef struct lv8_value lv8_value;
+enum {
+  LV8_TNIL,
+  LV8_TBOOLEAN,
+  LV8_TNUMBER,
+  LV8_TSTRING,
+  LV8_TBUFFER,
+  LV8_TOBJECT,
+  LV8_TFUNCTION,
+  LV8_TERROR
+};
+LV8_EXTERN lv8_value *lv8_number(double n);
+LV8_EXTERN lv8_value *lv8_boolean(int b);
+LV8_EXTERN lv8_value *lv8_string(const char *s, size_t len);
+LV8_EXTERN lv8_value *lv8_buffer(const void *p, size_t len);
+LV8_EXTERN lv8_value *lv8_global(struct lv8_context *ctx);
+LV8_EXTERN lv8_value *lv8_get(struct lv8_context *ctx, lv8_value *obj,
+    const char *key);
+LV8_EXTERN int lv8_set(struct lv8_context *ctx, lv8_value *obj,
+    const char *key, lv8_value *val);
+LV8_EXTERN lv8_value *lv8_call(struct lv8_context *ctx, lv8_value *fn,
+    lv8_value *self, int argc, lv8_value **argv);
+LV8_EXTERN int lv8_type(const lv8_value *v);
+LV8_EXTERN double lv8_tonumber(const lv8_value *v);
+LV8_EXTERN const char *lv8_tolstring(lv8_value *v, size_t *len);
+LV8_EXTERN void *lv8_tobuffer(lv8_value *v, size_t *len);
+LV8_EXTERN void lv8_free(lv8_value *v);
 
 #undef LV8_EXTERN
 
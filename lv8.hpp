@@ -37,23 +37,98 @@ enum {
 
 struct lv8_object {
   int type;
+  unsigned scoped:1; // Lives in lv8.scope() arena.
   v8::Persistent<v8::Object> object;
+  lv8_object *qnext; // Dead queue link.
 };
 
+/* Arena of Lua proxies created within lv8.scope(). */
+#define LV8_ARENA_CHUNK 64
+struct lv8_arena {
+  lv8_arena *next;
+  int n;
+  lv8_object objs[LV8_ARENA_CHUNK];
+};
+
+struct lv8_scope {
+  lv8_scope *prev; // Enclosing scope.
+  lv8_arena *arena;
+};
+
+/* lv8.configure() resource constraints, 0 means V8 default. */
+struct lv8_limits {
+  int max_old_space_mb;
+  int semi_space_kb; // Effective value, V8 takes MB.
+  int max_executable_mb;
+  int code_range_mb;
+  int stack_kb;
+};
+
+/*
+ * Native resource released at a bridge safepoint, rather than in the GC
+ * pause its weak callback runs in (lv8_defer()). release() returns false
+ * to be retried at a later safepoint. L is 0 once the state is closing,
+ * release then must not touch Lua, and may block.
+ */
+struct lv8_deferred {
+  lv8_deferred *dnext;
+  bool (*release)(lua_State *L, lv8_deferred *d);
+};
+
+class lv8_extstr;
 struct lv8_state {
   int initialized;
+  lv8_limits limits;
   v8::Persistent<v8::FunctionTemplate> proxy;
   v8::Persistent<v8::ObjectTemplate> gtpl;
+  v8::Persistent<v8::Context> uctx; // Utility context, never user-visible.
+  v8::Persistent<v8::Object> sbgen; // Sandbox cache key generations.
+  uint32_t sbepoch; // Sandbox cache flush counter.
+  int sbcaching; // Some sandbox caches globals, writes bump sbgen.
+  uint32_t lazystr; // Lazy JS string threshold, 0 if off.
+  lv8_scope *scope; // Innermost lv8.scope(), if any.
+  lv8_arena *spare; // Arena chunks for reuse.
+  lv8_object *dead; // Collected by JS, pushed by weak callbacks.
+  lv8_context *deadctx;
+  lv8_object *backlog; // Taken from 'dead', not yet released.
+  lv8_context *ctxbacklog;
+  lv8_extstr *deadext; // External strings V8 let go of.
+  lv8_deferred *deferred; // Weak callbacks' native releases.
   ptrdiff_t finhack;
 };
 
 struct lv8_context : lv8_object {
   v8::Persistent<v8::Context> context;
+  lua_State *L; // Owning state, used by C api.
+  v8::Persistent<v8::Array> checkpoint; // Saved globals (lv8.checkpoint).
   unsigned jscollected:1;
   unsigned resurrected:1;
+  unsigned cached:1; // Sandbox caches globals.
+  uint32_t epoch; // Last seen sbepoch.
+  lv8_context *cnext; // Dead context queue link.
+};
+
+/* lv8.buffer() userdata, shared with JS as ArrayBuffer. */
+struct lv8_buffer {
+  size_t len;
+  char *data;
+  v8::Persistent<v8::ArrayBuffer> ab; // Once seen by JS.
+};
+
+/* Lazy JS string handle (lv8.lazystrings). */
+struct lv8_jsstring {
+  v8::Persistent<v8::String> str;
+};
+
+/* lv8.regex() handle, compiled in utility context. */
+struct lv8_regex {
+  v8::Persistent<v8::RegExp> re;
+  v8::Persistent<v8::Function> exec; // RegExp.prototype.exec
 };
 
 /* Public C++ API, see lv8.cpp for usage. */
+#pragma GCC visibility push(default)
+#define LV8_DEAD_PROXY ((lv8_context*)-1) // lv8_unwrap_js(), never deref.
 void lv8_wrap_js2lua(lua_State *L, v8::Handle<v8::Object> o);
 lv8_context *lv8_unwrap_js(lua_State *L, v8::Handle<v8::Object> o, bool context = false);
 bool lv8_shallow_copy(lua_State *L, v8::Handle<v8::Object> dst, v8::Handle<v8::Object> o);
@@ -61,7 +136,88 @@ bool lv8_shallow_copy_from_lua(lua_State *L, v8::Handle<v8::Object> dst, int idx
 bool lv8_is_js_sandbox(lua_State *L, v8::Handle<v8::Object> o, lv8_context **cp);
 bool lv8_is_js_context(v8::Handle<v8::Object> o);
 void lv8_push(lua_State *L, lv8_object *v);
+void *lv8_get_buf(v8::Handle<v8::Object> b, size_t *len = 0);
+void lv8_adopt_buf(v8::Handle<v8::ArrayBuffer> ab, void *ptr);
+int lv8_capi_invoke(lua_State *L, void (*fn)(lua_State *, void *), void *ud);
+
+/* C api value handle. */
+struct lv8_value {
+  int type;
+  double num; // LV8_TNUMBER, LV8_TBOOLEAN.
+  v8::Persistent<v8::Value> value; // Once seen by V8.
+  char *data; // String copy or buffer data.
+  size_t len;
+};
+
+/* Platform (platform.cpp), task types ORDER lv8_platform::Step. */
+namespace v8 { class Task; }
+enum {
+  LV8_TASK_BACKGROUND,
+  LV8_TASK_LONG, // Of which long running (posted only).
+  LV8_TASK_FOREGROUND,
+  LV8_TASK_DELAYED,
+  LV8_TASK_IDLE,
+  LV8_TASK_MAX
+};
+struct lv8_platform_stats {
+  int threads;
+  uint64_t posted[LV8_TASK_MAX];
+  uint64_t ran[LV8_TASK_MAX];
+};
+int lv8_platform_setup(int threads, const int *cpus, int ncpus);
+double lv8_platform_step(double budget);
+int lv8_platform_delayed(v8::Task *task, double delay);
+int lv8_platform_idle(v8::Task *task);
+void lv8_platform_counters(lv8_platform_stats *st);
+
+/* perf map / jitdump (perfmap.cpp). */
+int lv8_perfmap_start(int jitdump);
+void lv8_perfmap_stop();
+
+/* User timing ring (trace.cpp), timestamps cross as ms. */
+#define LV8_TRACE_NOW ((uint64_t)-1) // lv8_trace_measure() end.
+static inline uint64_t lv8_ms2ns(double ms)
+{
+  if (!(ms > 0)) // Negative or NaN, out of range of the cast.
+    return 0;
+  return ms < 1.8e13 ? (uint64_t)(ms * 1e6) : LV8_TRACE_NOW - 1;
+}
+uint64_t lv8_trace_now();
+void lv8_trace_mark(const char *name, size_t len);
+void lv8_trace_measure(const char *name, size_t len, uint64_t start,
+    uint64_t end);
+void lv8_trace_drain(lua_State *L, int json);
+
+#pragma GCC visibility pop
 
 /* Binding. */
 v8::Handle<v8::ObjectTemplate> lv8_binding_init(lua_State *L);
+lv8_state *lv8_state_get(lua_State *L);
+void lv8_defer(lv8_state *state, lv8_deferred *d);
+
+/* Profiler (profiler.cpp). */
+enum { LV8_CROSS_LUA2JS, LV8_CROSS_JS2LUA };
+extern int lv8_prof_active;
+void lv8_prof_cross(lua_State *L, int kind);
+void lv8_prof_uncross();
+int lv8_prof_start(lua_State *L, int interval_us, int count);
+void lv8_prof_stop(lua_State *L);
+
+/* Marks bridge crossing for the extent of a C++ scope. */
+struct lv8_prof_guard {
+  bool on;
+  lv8_prof_guard(lua_State *L, int kind) : on(lv8_prof_active) {
+    if (on) lv8_prof_cross(L, kind);
+  }
+  ~lv8_prof_guard() {
+    if (on) lv8_prof_uncross();
+  }
+};
 
+/* Proxy allocation census (census.cpp). */
+extern int lv8_census_on;
+void lv8_census_enable(int on);
+void lv8_census_track(lua_State *L, lv8_object *v);
+void lv8_census_forget(lv8_object *v);
+void lv8_census_move(lv8_object *v, lv8_object *nv);
+void lv8_census_push(lua_State *L);
@@ -0,0 +1,290 @@
+/*
+ * Lua <-> V8 bridge, JIT symbols for perf.
+ * (C) Copyright 2014, Karel Tuma <kat@lua.cz>, All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NDEBUG
+#include <v8-debug.h>
+#else
+#include <v8.h>
+#endif
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <elf.h>
+
+#define LV8_CPP
+#include "lv8.hpp"
+#include "macros.hpp"
+
+using namespace v8;
+
+#if !NON_POSIX
+/*
+ * Notes on perf map:
+ *
+ * V8 reports JIT code through SetJitCodeEventHandler. Every added
+ * function is appended to /tmp/perf-PID.map ("start size name"), which
+ * perf reads as is. Code moved by the GC is re-announced at the new
+ * address under the old name (perf honours the latest mapping), so we
+ * keep an address -> name table for code alive. Optionally the same is
+ * written as jitdump (/tmp/jit-PID.dump), including code bytes, for
+ * 'perf record -k mono' followed by 'perf inject --jit'.
+ */
+#define PM_BUCKETS 4096
+#define PM_HASH(a) ((((uintptr_t)(a)) >> 4) % PM_BUCKETS)
+
+struct pm_code {
+  pm_code *next;
+  void *start;
+  size_t len;
+  uint64_t index; // jitdump code index.
+  char name[1];
+};
+
+/* jitdump records, see tools/perf/Documentation/jitdump-specification. */
+#define JD_MAGIC 0x4A695444
+#define JD_CODE_LOAD 0
+#define JD_CODE_MOVE 1
+#if defined(__x86_64__)
+#define JD_MACH EM_X86_64
+#elif defined(__aarch64__)
+#define JD_MACH EM_AARCH64
+#elif defined(__arm__)
+#define JD_MACH EM_ARM
+#else
+#define JD_MACH EM_386
+#endif
+
+struct jd_header {
+  uint32_t magic, version, total_size, elf_mach, pad1, pid;
+  uint64_t timestamp, flags;
+};
+struct jd_record {
+  uint32_t id, total_size;
+  uint64_t timestamp;
+};
+struct jd_load {
+  jd_record h;
+  uint32_t pid, tid;
+  uint64_t vma, code_addr, code_size, code_index;
+};
+struct jd_move {
+  jd_record h;
+  uint32_t pid, tid;
+  uint64_t vma, old_code_addr, new_code_addr, code_size, code_index;
+};
+
+static pthread_mutex_t pm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pm_code *pm_table[PM_BUCKETS];
+static FILE *pm_map;
+static FILE *pm_dump;
+static void *pm_marker; // jitdump mmap, tells perf about the file.
+static uint64_t pm_index;
+
+static uint64_t pm_timestamp()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void pm_write_map(void *start, size_t len, const char *name)
+{
+  fprintf(pm_map, "%lx %lx %s\n", (unsigned long)start,
+      (unsigned long)len, name);
+  fflush(pm_map);
+}
+
+static void pm_write_load(pm_code *c)
+{
+  size_t nlen = strlen(c->name) + 1;
+  jd_load r;
+  memset(&r, 0, sizeof(r));
+  r.h.id = JD_CODE_LOAD;
+  r.h.total_size = sizeof(r) + nlen + c->len;
+  r.h.timestamp = pm_timestamp();
+  r.pid = getpid();
+  r.tid = syscall(SYS_gettid);
+  r.vma = r.code_addr = (uintptr_t)c->start;
+  r.code_size = c->len;
+  r.code_index = c->index;
+  fwrite(&r, sizeof(r), 1, pm_dump);
+  fwrite(c->name, nlen, 1, pm_dump);
+  fwrite(c->start, c->len, 1, pm_dump);
+  fflush(pm_dump);
+}
+
+static void pm_write_move(pm_code *c, void *from)
+{
+  jd_move r;
+  memset(&r, 0, sizeof(r));
+  r.h.id = JD_CODE_MOVE;
+  r.h.total_size = sizeof(r);
+  r.h.timestamp = pm_timestamp();
+  r.pid = getpid();
+  r.tid = syscall(SYS_gettid);
+  r.vma = r.new_code_addr = (uintptr_t)c->start;
+  r.old_code_addr = (uintptr_t)from;
+  r.code_size = c->len;
+  r.code_index = c->index;
+  fwrite(&r, sizeof(r), 1, pm_dump);
+  fflush(pm_dump);
+}
+
+/* Unlink code at start from table. */
+static pm_code *pm_take(void *start)
+{
+  for (pm_code **p = &pm_table[PM_HASH(start)]; *p; p = &(*p)->next) {
+    if ((*p)->start == start) {
+      pm_code *c = *p;
+      *p = c->next;
+      return c;
+    }
+  }
+  return 0;
+}
+
+static void pm_put(pm_code *c)
+{
+  pm_code **b = &pm_table[PM_HASH(c->start)];
+  c->next = *b;
+  *b = c;
+}
+
+static void pm_event(const JitCodeEvent *ev)
+{
+  pm_code *c;
+  pthread_mutex_lock(&pm_lock);
+  if (!pm_map) {
+    pthread_mutex_unlock(&pm_lock);
+    return; // Stopped meanwhile.
+  }
+  switch (ev->type) {
+    case JitCodeEvent::CODE_ADDED:
+      free(pm_take(ev->code_start)); // Address reused.
+      c = (pm_code*)malloc(sizeof(*c) + ev->name.len);
+      c->start = ev->code_start;
+      c->len = ev->code_len;
+      c->index = pm_index++;
+      memcpy(c->name, ev->name.str, ev->name.len);
+      c->name[ev->name.len] = 0;
+      pm_put(c);
+      pm_write_map(c->start, c->len, c->name);
+      if (pm_dump)
+        pm_write_load(c);
+      break;
+    case JitCodeEvent::CODE_MOVED:
+      if ((c = pm_take(ev->code_start))) {
+        void *from = c->start;
+        free(pm_take(ev->new_code_start));
+        c->start = ev->new_code_start;
+        pm_put(c);
+        pm_write_map(c->start, c->len, c->name);
+        if (pm_dump)
+          pm_write_move(c, from);
+      }
+      break;
+    case JitCodeEvent::CODE_REMOVED:
+      free(pm_take(ev->code_start));
+      break;
+    default: // Line info is not used.
+      break;
+  }
+  pthread_mutex_unlock(&pm_lock);
+}
+
+/* Open jitdump and announce it to perf via executable mapping. */
+static FILE *pm_open_dump()
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+  FILE *f = fopen(path, "w+");
+  if (!f)
+    return 0;
+  jd_header h;
+  memset(&h, 0, sizeof(h));
+  h.magic = JD_MAGIC;
+  h.version = 1;
+  h.total_size = sizeof(h);
+  h.elf_mach = JD_MACH;
+  h.pid = getpid();
+  h.timestamp = pm_timestamp();
+  fwrite(&h, sizeof(h), 1, f);
+  fflush(f);
+  pm_marker = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ|PROT_EXEC,
+      MAP_PRIVATE, fileno(f), 0);
+  if (pm_marker == MAP_FAILED)
+    pm_marker = 0;
+  return f;
+}
+
+//////////////////////////////// PUBLIC //////////////////////////////
+
+/* Start writing perf map (and jitdump), returns 0 on success. */
+int lv8_perfmap_start(int jitdump)
+{
+  char path[64];
+  pthread_mutex_lock(&pm_lock);
+  if (pm_map) {
+    pthread_mutex_unlock(&pm_lock);
+    return 0; // Already running.
+  }
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  pm_map = fopen(path, "a");
+  if (pm_map && jitdump)
+    pm_dump = pm_open_dump();
+  pthread_mutex_unlock(&pm_lock);
+  if (!pm_map)
+    return -1;
+  V8::SetJitCodeEventHandler(kJitCodeEventEnumExisting, pm_event);
+  return 0;
+}
+
+/* Stop listening, files stay for perf. */
+void lv8_perfmap_stop()
+{
+  V8::SetJitCodeEventHandler(kJitCodeEventDefault, 0);
+  pthread_mutex_lock(&pm_lock);
+  if (pm_map)
+    fclose(pm_map);
+  if (pm_dump)
+    fclose(pm_dump);
+  if (pm_marker)
+    munmap(pm_marker, sysconf(_SC_PAGESIZE));
+  pm_map = pm_dump = 0;
+  pm_marker = 0;
+  for (int i = 0; i < PM_BUCKETS; i++) {
+    while (pm_code *c = pm_table[i]) {
+      pm_table[i] = c->next;
+      free(c);
+    }
+  }
+  pthread_mutex_unlock(&pm_lock);
+}
+#endif
@@ -0,0 +1,49 @@
+--
+-- Representative workload for profile guided build ('make pgo').
+-- Exercises the bridge hot paths: argument/result conversion,
+-- proxy interceptors, and JS object access from Lua.
+--
+local lv8 = require "lv8"
+local eval = lv8.binding.eval
+local N = tonumber(arg and arg[1]) or 100000
+
+-- Lua -> JS calls.
+local ctx = lv8.context()
+local add = eval(ctx, "(function(a, b) { return a + b })", "pgo.js")
+for i = 1, N do
+  add(i, i)
+  add("a", "b")
+end
+
+-- JS -> Lua calls, sandbox and Lua table interceptors.
+local env = { n = 0, t = {}, inc = function(x) return x + 1 end }
+local sb = lv8.sandbox(env)
+local loop = eval(sb, [[(function(count) {
+  for (var i = 1; i <= count; i++) {
+    t[i] = inc(i)[0];
+    n = n + 1;
+  }
+  var keys = 0;
+  for (var k in t) keys++;
+  return keys;
+})]], "pgo.js")
+loop(N)
+
+-- JS objects from Lua: index, newindex, pairs, ipairs.
+local o = eval(ctx, "({ a: 1, b: [1, 2, 3] })", "pgo.js")
+for i = 1, N do
+  o.a = o.a + 1
+  local _ = o.b[1]
+end
+for i = 1, N / 100 do
+  for k, v in pairs(o) do end
+  for _, v in ipairs(o.b) do end
+end
+
+-- Proxy churn through both garbage collectors.
+local first = eval(ctx, "(function(a, b) { return a })", "pgo.js")
+for i = 1, N / 10 do
+  first({}, {})
+end
+collectgarbage()
+lv8.gc()
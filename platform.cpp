@@ -0,0 +1,304 @@
+/*
+ * Lua <-> V8 bridge, v8::Platform implementation.
+ * (C) Copyright 2014, Karel Tuma <kat@lua.cz>, All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np()
+#endif
+#ifndef NDEBUG
+#include <v8-debug.h>
+#else
+#include <v8.h>
+#endif
+#include <v8-platform.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define LV8_CPP
+#include "lv8.hpp"
+#include "macros.hpp"
+
+using namespace v8;
+
+#if !NON_POSIX
+/*
+ * Notes on platform:
+ *
+ * One platform per process (V8 wants it before initialization), made
+ * only by lv8.platform{}, otherwise V8 keeps its own. Background
+ * tasks run on a fixed number of workers, optionally pinned to CPUs.
+ * Foreground, delayed and idle tasks are queued and only ever run from
+ * lv8_platform_step() (lv8.gc.step()), ie on the thread owning the
+ * isolate, at a time of its choosing. This V8 only posts background and
+ * foreground tasks; delayed and idle queues are open to embedder code
+ * through lv8_platform_delayed() and lv8_platform_idle().
+ */
+#define LV8_PLATFORM_THREADS 2 // Default worker count.
+#define LV8_PLATFORM_MAXTHREADS 256
+
+struct lv8_task {
+  lv8_task *next;
+  Task *task;
+  double due; // Delayed only, monotonic seconds.
+};
+
+/* Monotonic time in seconds. */
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+class lv8_platform : public Platform {
+  public:
+  lv8_platform(int threads, const int *cpus, int ncpus);
+  virtual void CallOnBackgroundThread(Task *task, ExpectedRuntime rt);
+  virtual void CallOnForegroundThread(Isolate *isolate, Task *task);
+  void CallDelayedOnForegroundThread(Isolate *isolate, Task *task,
+      double delay);
+  void CallIdleOnForegroundThread(Isolate *isolate, Task *task);
+  double Step(double deadline);
+  void Counters(lv8_platform_stats *st);
+
+  private:
+  static void *Worker(void *arg);
+  void Push(lv8_task **q, lv8_task *t, int type);
+  lv8_task *Pop(lv8_task **q);
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  lv8_task *background;
+  lv8_task *foreground;
+  lv8_task *delayed; // Sorted by due.
+  lv8_task *idle;
+  int nthreads;
+  uint64_t posted[LV8_TASK_MAX];
+  uint64_t ran[LV8_TASK_MAX];
+};
+
+static lv8_platform *platform;
+
+lv8_platform::lv8_platform(int threads, const int *cpus, int ncpus)
+{
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&cond, 0);
+  background = foreground = delayed = idle = 0;
+  memset(posted, 0, sizeof(posted));
+  memset(ran, 0, sizeof(ran));
+  nthreads = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_t th;
+    if (pthread_create(&th, 0, Worker, this))
+      break;
+    pthread_detach(th); // Lives as long as the process.
+#ifdef __linux__
+    if (ncpus > 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i % ncpus], &set);
+      pthread_setaffinity_np(th, sizeof(set), &set);
+    }
+#endif
+    nthreads++;
+  }
+}
+
+/* Append t to q (delayed q is kept sorted), lock held. */
+void lv8_platform::Push(lv8_task **q, lv8_task *t, int type)
+{
+  while (*q && (q != &delayed || (*q)->due <= t->due))
+    q = &(*q)->next;
+  t->next = *q;
+  *q = t;
+  posted[type]++;
+}
+
+/* Take head of q, lock held. */
+lv8_task *lv8_platform::Pop(lv8_task **q)
+{
+  lv8_task *t = *q;
+  if (t)
+    *q = t->next;
+  return t;
+}
+
+void *lv8_platform::Worker(void *arg)
+{
+  lv8_platform *p = (lv8_platform*)arg;
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    lv8_task *t;
+    while (!(t = p->Pop(&p->background)))
+      pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    t->task->Run();
+    delete t->task;
+    delete t;
+    pthread_mutex_lock(&p->lock);
+    p->ran[LV8_TASK_BACKGROUND]++;
+  }
+  return 0;
+}
+
+void lv8_platform::CallOnBackgroundThread(Task *task, ExpectedRuntime rt)
+{
+  lv8_task *t = new lv8_task();
+  t->task = task;
+  pthread_mutex_lock(&lock);
+  Push(&background, t, LV8_TASK_BACKGROUND);
+  if (rt == kLongRunningTask)
+    posted[LV8_TASK_LONG]++;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+void lv8_platform::CallOnForegroundThread(Isolate *isolate, Task *task)
+{
+  lv8_task *t = new lv8_task();
+  t->task = task;
+  pthread_mutex_lock(&lock);
+  Push(&foreground, t, LV8_TASK_FOREGROUND);
+  pthread_mutex_unlock(&lock);
+}
+
+void lv8_platform::CallDelayedOnForegroundThread(Isolate *isolate,
+    Task *task, double delay)
+{
+  lv8_task *t = new lv8_task();
+  t->task = task;
+  t->due = now() + delay;
+  pthread_mutex_lock(&lock);
+  Push(&delayed, t, LV8_TASK_DELAYED);
+  pthread_mutex_unlock(&lock);
+}
+
+void lv8_platform::CallIdleOnForegroundThread(Isolate *isolate, Task *task)
+{
+  lv8_task *t = new lv8_task();
+  t->task = task;
+  pthread_mutex_lock(&lock);
+  Push(&idle, t, LV8_TASK_IDLE);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Run foreground and due delayed tasks, then idle ones until deadline. */
+double lv8_platform::Step(double deadline)
+{
+  for (int type = LV8_TASK_FOREGROUND; type <= LV8_TASK_IDLE; type++) {
+    for (;;) {
+      lv8_task *t = 0;
+      double n = now();
+      if (type == LV8_TASK_IDLE && n >= deadline)
+        break; // Out of idle time.
+      pthread_mutex_lock(&lock);
+      if (type == LV8_TASK_FOREGROUND)
+        t = Pop(&foreground);
+      else if (type == LV8_TASK_IDLE)
+        t = Pop(&idle);
+      else if (delayed && delayed->due <= n)
+        t = Pop(&delayed);
+      if (t)
+        ran[type]++;
+      pthread_mutex_unlock(&lock);
+      if (!t)
+        break;
+      t->task->Run();
+      delete t->task;
+      delete t;
+    }
+  }
+  double left = deadline - now();
+  return left > 0 ? left : 0;
+}
+
+void lv8_platform::Counters(lv8_platform_stats *st)
+{
+  pthread_mutex_lock(&lock);
+  st->threads = nthreads;
+  memcpy(st->posted, posted, sizeof(posted));
+  memcpy(st->ran, ran, sizeof(ran));
+  pthread_mutex_unlock(&lock);
+}
+
+//////////////////////////////// PUBLIC //////////////////////////////
+
+/* Install platform with given workers (<0 default) pinned to cpus. */
+int lv8_platform_setup(int threads, const int *cpus, int ncpus)
+{
+  if (platform)
+    return -1; // V8 has it already.
+  if (threads < 0)
+    threads = LV8_PLATFORM_THREADS;
+  if (threads > LV8_PLATFORM_MAXTHREADS)
+    threads = LV8_PLATFORM_MAXTHREADS;
+  platform = new lv8_platform(threads, cpus, ncpus);
+  V8::InitializePlatform(platform);
+  return 0;
+}
+
+/* Run queued foreground work for up to 'budget' seconds, returns rest. */
+double lv8_platform_step(double budget)
+{
+  if (!platform)
+    return budget;
+  return platform->Step(now() + budget);
+}
+
+/*
+ * Queue task to run from lv8_platform_step() after delay seconds.
+ * Without lv8.platform{} there is no queue, task is deleted, -1 returned.
+ */
+int lv8_platform_delayed(Task *task, double delay)
+{
+  if (!platform) {
+    delete task;
+    return -1;
+  }
+  platform->CallDelayedOnForegroundThread(ISOLATE, task, delay);
+  return 0;
+}
+
+/* Queue task to run from lv8_platform_step() when time is left. */
+int lv8_platform_idle(Task *task)
+{
+  if (!platform) {
+    delete task;
+    return -1;
+  }
+  platform->CallIdleOnForegroundThread(ISOLATE, task);
+  return 0;
+}
+
+/* Task counters, zeroes if no platform. */
+void lv8_platform_counters(lv8_platform_stats *st)
+{
+  memset(st, 0, sizeof(*st));
+  if (platform)
+    platform->Counters(st);
+}
+#endif
@@ -0,0 +1,306 @@
+/*
+ * Lua <-> V8 bridge, mixed Lua and JS sampling profiler.
+ * (C) Copyright 2014, Karel Tuma <kat@lua.cz>, All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NDEBUG
+#include <v8-debug.h>
+#else
+#include <v8.h>
+#endif
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LV8_CPP
+#include "lv8.hpp"
+#include "macros.hpp"
+
+using namespace v8;
+
+#if !NON_POSIX
+/*
+ * Notes on profiler:
+ *
+ * A sampler thread raises 'pending' every interval and asks V8 for an
+ * interrupt. Whichever side notices first takes the sample, on the main
+ * thread: the Lua count hook while Lua runs, the V8 interrupt while JS
+ * runs. Both stacks are captured whole (Lua via lua_getstack, JS via
+ * StackTrace) and stitched using the crossing stack, which records the
+ * depth of both stacks at every bridge entry (lv8_prof_guard in
+ * CB_LUA_COMMON and exception()). Samples are aggregated as folded
+ * stacks ("outer;...;inner count"), ready for flamegraph.pl.
+ */
+#define PROF_MAXCROSS 64
+#define PROF_MAXLUA 128
+#define PROF_MAXJS 128
+#define PROF_BUCKETS 1024
+#define PROF_FOLDED 8192
+
+struct prof_cross {
+  int kind; // LV8_CROSS_*
+  lua_State *L; // Thread which crossed, ld is its depth.
+  int ld, jd; // Lua and JS depth at crossing.
+};
+
+struct prof_stack {
+  prof_stack *next;
+  unsigned long count;
+  char folded[1];
+};
+
+int lv8_prof_active;
+static lua_State *prof_L;
+static Isolate *prof_isolate;
+static volatile int prof_pending;
+static volatile int prof_stop;
+static int prof_interval; // us
+static pthread_t prof_thread;
+static prof_cross prof_crossing[PROF_MAXCROSS];
+static int prof_ncross; // May exceed PROF_MAXCROSS, only that many kept.
+static prof_stack *prof_table[PROF_BUCKETS];
+static lua_Hook prof_ohook; // Restored on stop.
+static int prof_omask, prof_ocount;
+
+/* Number of Lua frames. */
+static int lua_depth(lua_State *L)
+{
+  lua_Debug ar;
+  int lo = 0, hi = 1;
+  while (lua_getstack(L, hi, &ar)) { // Exponential, then binary search.
+    lo = hi;
+    hi *= 2;
+  }
+  while (lo + 1 < hi) {
+    int mid = (lo + hi) / 2;
+    if (lua_getstack(L, mid, &ar))
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lua_getstack(L, 0, &ar) ? hi : 0;
+}
+
+/* Append frame name to folded buffer. */
+static void fold(char *buf, size_t *n, const char *s)
+{
+  if (*n && *n < PROF_FOLDED - 1)
+    buf[(*n)++] = ';';
+  for (; *s && *n < PROF_FOLDED - 1; s++)
+    buf[(*n)++] = (*s == ';' || *s == ' ') ? '_' : *s;
+  buf[*n] = 0;
+}
+
+static void fold_lua(char *buf, size_t *n, lua_Debug *ar)
+{
+  char name[256];
+  snprintf(name, sizeof(name), "%s@%s:%d", ar->name ? ar->name : "?",
+      ar->short_src, ar->linedefined);
+  fold(buf, n, name);
+}
+
+static void fold_js(char *buf, size_t *n, Handle<StackFrame> f)
+{
+  char name[256];
+  String::Utf8Value fn(f->GetFunctionName());
+  String::Utf8Value sn(f->GetScriptName());
+  snprintf(name, sizeof(name), "%s@%s:%d [js]",
+      *fn && **fn ? *fn : "(anonymous)", *sn ? *sn : "?",
+      f->GetLineNumber());
+  fold(buf, n, name);
+}
+
+/* Count one folded stack. */
+static void prof_count(const char *folded, size_t n)
+{
+  unsigned h = 2166136261u;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ (unsigned char)folded[i]) * 16777619u;
+  prof_stack **b = &prof_table[h % PROF_BUCKETS];
+  for (prof_stack *s = *b; s; s = s->next) {
+    if (!strcmp(s->folded, folded)) {
+      s->count++;
+      return;
+    }
+  }
+  prof_stack *s = (prof_stack*)malloc(sizeof(*s) + n);
+  memcpy(s->folded, folded, n + 1);
+  s->count = 1;
+  s->next = *b;
+  *b = s;
+}
+
+/* Take the sample, both stacks stitched outermost first. */
+static void prof_sample(lua_State *L)
+{
+  HandleScope scope(prof_isolate);
+  lua_Debug lar[PROF_MAXLUA];
+  int nl = 0, level = lua_depth(L);
+  for (int i = level - 1; i >= 0 && nl < PROF_MAXLUA; i--) {
+    lua_getstack(L, i, &lar[nl]);
+    lua_getinfo(L, "Sn", &lar[nl]);
+    nl++;
+  }
+  Handle<StackTrace> st = StackTrace::CurrentStackTrace(prof_isolate,
+      PROF_MAXJS, StackTrace::kOverview);
+  int nj = st.IsEmpty() ? 0 : st->GetFrameCount();
+
+  char buf[PROF_FOLDED];
+  size_t n = 0;
+  int l = 0, j = 0, kind = LV8_CROSS_JS2LUA; // Lua runs first.
+  buf[0] = 0;
+  int ncross = prof_ncross < PROF_MAXCROSS ? prof_ncross : PROF_MAXCROSS;
+  for (int c = 0; c < ncross; c++) {
+    prof_cross *x = &prof_crossing[c];
+    if (x->kind == LV8_CROSS_LUA2JS) {
+      for (; l < x->ld && l < nl; l++)
+        fold_lua(buf, &n, &lar[l]);
+      fold(buf, &n, "[lua->js]");
+    } else {
+      for (; j < x->jd && j < nj; j++) // StackTrace is innermost first.
+        fold_js(buf, &n, st->GetFrame(nj - 1 - j));
+      fold(buf, &n, "[js->lua]");
+    }
+    kind = x->kind;
+  }
+  /* Rest of the side which was left, then the running one. */
+  if (kind == LV8_CROSS_LUA2JS) {
+    for (; l < nl; l++)
+      fold_lua(buf, &n, &lar[l]);
+    for (; j < nj; j++)
+      fold_js(buf, &n, st->GetFrame(nj - 1 - j));
+  } else {
+    for (; j < nj; j++)
+      fold_js(buf, &n, st->GetFrame(nj - 1 - j));
+    for (; l < nl; l++)
+      fold_lua(buf, &n, &lar[l]);
+  }
+  if (n)
+    prof_count(buf, n);
+}
+
+/*
+ * Coroutines made while profiling inherit this hook, lv8_prof_stop()
+ * cannot reach them. They hand back what they would have inherited
+ * on their first count past stop.
+ */
+static void prof_hook(lua_State *L, lua_Debug *ar)
+{
+  if (!lv8_prof_active) {
+    lua_sethook(L, prof_ohook, prof_omask, prof_ocount);
+    return;
+  }
+  if (prof_pending && __sync_bool_compare_and_swap(&prof_pending, 1, 0))
+    prof_sample(L);
+}
+
+/* JS runs, Lua stack is that of the thread which last crossed over. */
+static void prof_interrupt(Isolate *isolate, void *data)
+{
+  if (prof_pending && __sync_bool_compare_and_swap(&prof_pending, 1, 0)) {
+    int c = prof_ncross < PROF_MAXCROSS ? prof_ncross : PROF_MAXCROSS;
+    prof_sample(c ? prof_crossing[c - 1].L : prof_L);
+  }
+}
+
+static void *prof_sampler(void *arg)
+{
+  struct timespec ts = { prof_interval / 1000000,
+    (prof_interval % 1000000) * 1000 };
+  while (!prof_stop) {
+    nanosleep(&ts, 0);
+    prof_pending = 1;
+    prof_isolate->RequestInterrupt(prof_interrupt, 0);
+  }
+  return 0;
+}
+
+//////////////////////////////// PUBLIC //////////////////////////////
+
+/* Bridge entered in 'kind' direction (only while profiling). */
+void lv8_prof_cross(lua_State *L, int kind)
+{
+  if (prof_ncross < PROF_MAXCROSS) {
+    prof_cross *x = &prof_crossing[prof_ncross];
+    x->kind = kind;
+    x->L = L;
+    x->ld = lua_depth(L);
+    HandleScope scope(prof_isolate);
+    Handle<StackTrace> st = StackTrace::CurrentStackTrace(prof_isolate,
+        PROF_MAXJS, StackTrace::kOverview);
+    x->jd = st.IsEmpty() ? 0 : st->GetFrameCount();
+  }
+  prof_ncross++;
+}
+
+void lv8_prof_uncross()
+{
+  if (prof_ncross > 0)
+    prof_ncross--;
+}
+
+/* Start sampling L every interval_us, Lua hook every count insns. */
+int lv8_prof_start(lua_State *L, int interval_us, int count)
+{
+  if (lv8_prof_active)
+    return -1;
+  prof_L = L;
+  prof_isolate = ISOLATE;
+  prof_interval = interval_us > 0 ? interval_us : 1000;
+  prof_pending = prof_stop = 0;
+  prof_ncross = 0;
+  prof_ohook = lua_gethook(L);
+  prof_omask = lua_gethookmask(L);
+  prof_ocount = lua_gethookcount(L);
+  if (pthread_create(&prof_thread, 0, prof_sampler, 0))
+    return -1;
+  lua_sethook(L, prof_hook, LUA_MASKCOUNT, count > 0 ? count : 1000);
+  lv8_prof_active = 1;
+  return 0;
+}
+
+/* Stop sampling, push folded stacks as string. */
+void lv8_prof_stop(lua_State *L)
+{
+  luaL_Buffer b;
+  if (lv8_prof_active) {
+    prof_stop = 1;
+    pthread_join(prof_thread, 0);
+    lua_sethook(prof_L, prof_ohook, prof_omask, prof_ocount);
+    lv8_prof_active = 0;
+  }
+  luaL_buffinit(L, &b);
+  for (int i = 0; i < PROF_BUCKETS; i++) {
+    while (prof_stack *s = prof_table[i]) {
+      char cnt[32];
+      luaL_addstring(&b, s->folded);
+      snprintf(cnt, sizeof(cnt), " %lu\n", s->count);
+      luaL_addstring(&b, cnt);
+      prof_table[i] = s->next;
+      free(s);
+    }
+  }
+  luaL_pushresult(&b);
+}
+#endif
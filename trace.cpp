@@ -0,0 +1,259 @@
+/*
+ * Lua <-> V8 bridge, user timing trace ring.
+ * (C) Copyright 2014, Karel Tuma <kat@lua.cz>, All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NDEBUG
+#include <v8-debug.h>
+#else
+#include <v8.h>
+#endif
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define LV8_CPP
+#include "lv8.hpp"
+#include "macros.hpp"
+
+using namespace v8;
+
+#if !NON_POSIX
+/*
+ * Notes on trace ring:
+ *
+ * Each thread records marks (instants) and measures (spans) into its own
+ * ring, so the writer never takes a lock nor contends: it fills the slot
+ * and publishes it by bumping 'head'. Old entries are overwritten once
+ * the ring wraps. Rings are registered once per thread in a global list
+ * for lv8_trace_drain(), which consumes everything since the last drain
+ * and renders it as Chrome trace-event JSON (chrome://tracing, Perfetto)
+ * or plain text. Timestamps are CLOCK_MONOTONIC ns, relative to the first
+ * use, exposed to scripts in ms like performance.now(). Rings of threads
+ * which exited are freed by the first drain which empties them.
+ */
+#define TRACE_SIZE 16384 // Entries per thread, power of two.
+#define TRACE_NAME 40
+
+struct trace_entry {
+  uint64_t ts, dur; // ns, dur == 0 for marks.
+  char name[TRACE_NAME];
+};
+
+struct trace_ring {
+  trace_ring *next;
+  int tid;
+  volatile uint64_t head; // Entries written.
+  uint64_t tail; // Entries drained.
+  volatile int dead; // Thread exited, free once drained.
+  trace_entry e[TRACE_SIZE];
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *trace_rings;
+static __thread trace_ring *trace_mine;
+static pthread_key_t trace_key; // Exit notification, ring as value.
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static uint64_t trace_epoch;
+
+static uint64_t trace_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Thread of ring r exited. */
+static void trace_ring_exit(void *r)
+{
+  ((trace_ring*)r)->dead = 1;
+}
+
+static void trace_key_init()
+{
+  pthread_key_create(&trace_key, trace_ring_exit);
+}
+
+/* Ring of calling thread. */
+static trace_ring *trace_ring_get()
+{
+  if (trace_mine)
+    return trace_mine;
+  trace_ring *r = (trace_ring*)calloc(1, sizeof(*r));
+  r->tid = syscall(SYS_gettid);
+  pthread_once(&trace_once, trace_key_init);
+  pthread_setspecific(trace_key, r);
+  pthread_mutex_lock(&trace_lock);
+  r->next = trace_rings;
+  trace_rings = r;
+  pthread_mutex_unlock(&trace_lock);
+  return trace_mine = r;
+}
+
+static void trace_put(const char *name, size_t len, uint64_t ts, uint64_t dur)
+{
+  trace_ring *r = trace_ring_get();
+  trace_entry *e = &r->e[r->head & (TRACE_SIZE - 1)];
+  if (len >= TRACE_NAME)
+    len = TRACE_NAME - 1;
+  memcpy(e->name, name, len);
+  e->name[len] = 0;
+  e->ts = ts;
+  e->dur = dur;
+  __sync_synchronize(); // Publish entry before head.
+  r->head++;
+}
+
+/* JSON string body, names are short and mostly plain. */
+static void trace_json_name(luaL_Buffer *b, const char *s)
+{
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      luaL_addchar(b, '\\');
+    if ((unsigned char)*s < 0x20)
+      luaL_addchar(b, '?');
+    else
+      luaL_addchar(b, *s);
+  }
+}
+
+/* Entries taken out of the rings by lv8_trace_drain(). */
+struct trace_event {
+  trace_entry e;
+  int tid;
+};
+
+struct trace_dump {
+  trace_event *ev;
+  size_t n;
+  int json;
+};
+
+/* Render trace_dump at 1 as Chrome JSON or text, protected. */
+static int trace_render(lua_State *L)
+{
+  trace_dump *d = (trace_dump*)lua_touserdata(L, 1);
+  luaL_Buffer b;
+  char tmp[128];
+  int pid = getpid();
+  luaL_buffinit(L, &b);
+  if (d->json)
+    luaL_addstring(&b, "{\"traceEvents\":[");
+  for (size_t i = 0; i < d->n; i++) {
+    trace_entry *e = &d->ev[i].e;
+    int tid = d->ev[i].tid;
+    if (d->json) {
+      luaL_addstring(&b, !i ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+      trace_json_name(&b, e->name);
+      if (e->dur)
+        snprintf(tmp, sizeof(tmp), "\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+            e->ts / 1e3, e->dur / 1e3, pid, tid);
+      else
+        snprintf(tmp, sizeof(tmp), "\",\"ph\":\"i\",\"s\":\"t\","
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", e->ts / 1e3, pid, tid);
+      luaL_addstring(&b, tmp);
+    } else {
+      snprintf(tmp, sizeof(tmp), "%d %.3f %.3f ", tid,
+          e->ts / 1e6, e->dur / 1e6);
+      luaL_addstring(&b, tmp);
+      luaL_addstring(&b, e->name);
+      luaL_addchar(&b, '\n');
+    }
+  }
+  if (d->json)
+    luaL_addstring(&b, "\n]}\n");
+  luaL_pushresult(&b);
+  return 1;
+}
+
+//////////////////////////////// PUBLIC //////////////////////////////
+
+/* Nanoseconds since trace epoch. */
+uint64_t lv8_trace_now()
+{
+  uint64_t t = trace_clock();
+  if (!trace_epoch)
+    __sync_bool_compare_and_swap(&trace_epoch, 0, t);
+  return t - trace_epoch;
+}
+
+/* Record instant. */
+void lv8_trace_mark(const char *name, size_t len)
+{
+  trace_put(name, len, lv8_trace_now(), 0);
+}
+
+/* Record span [start, end), end LV8_TRACE_NOW means now. */
+void lv8_trace_measure(const char *name, size_t len, uint64_t start,
+    uint64_t end)
+{
+  if (end == LV8_TRACE_NOW)
+    end = lv8_trace_now();
+  trace_put(name, len, start, end > start ? end - start : 1);
+}
+
+/* Push everything recorded since last drain as Chrome JSON or text. */
+void lv8_trace_drain(lua_State *L, int json)
+{
+  trace_dump d = { 0, 0, json };
+  size_t cap = 0;
+  pthread_mutex_lock(&trace_lock); // Only copy out, Lua may longjmp.
+  for (trace_ring **rp = &trace_rings, *r; (r = *rp);) {
+    int dead = r->dead; // Before head, no more writes if set.
+    __sync_synchronize();
+    uint64_t head = r->head;
+    __sync_synchronize();
+    if (head - r->tail >= TRACE_SIZE) // Overwritten meanwhile, and the
+      r->tail = head - TRACE_SIZE + 1; // oldest slot may be in writing.
+    for (; r->tail < head; r->tail++) {
+      if (d.n == cap) {
+        size_t ncap = cap ? cap * 2 : 1024;
+        trace_event *ev = (trace_event*)realloc(d.ev, ncap * sizeof(*ev));
+        if (!ev)
+          break; // Rest stays for the next drain.
+        d.ev = ev;
+        cap = ncap;
+      }
+      d.ev[d.n].e = r->e[r->tail & (TRACE_SIZE - 1)];
+      d.ev[d.n++].tid = r->tid;
+    }
+    if (dead && r->tail == head) {
+      *rp = r->next;
+      free(r);
+    } else {
+      rp = &r->next;
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+  lua_pushcfunction(L, trace_render);
+  lua_pushlightuserdata(L, &d);
+  int status = lua_pcall(L, 1, 1, 0);
+  free(d.ev);
+  if (status != LUA_OK)
+    lua_error(L);
+}
+#endif